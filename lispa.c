@@ -1,46 +1,87 @@
 
-/* compile commands
-linux: cc -std=c99 -Wall lispa.c mpc.c -ledit -lm -o lispa
-windows: cc -std=c99 -Wall lispa.c mpc.c -o lispa
+/* lispa library, see lispa.h and main.c for the command line interface
+compile commands
+static: cc -std=c99 -Wall -c lispa.c mpc.c && ar rcs liblispa.a lispa.o mpc.o
+shared: cc -std=c99 -Wall -fPIC -shared lispa.c mpc.c -lm -pthread -o liblispa.so
 */
 
+// For pthreads and sysconf under -std=c99
+#define _POSIX_C_SOURCE 200809L
+// For MAP_ANONYMOUS, used by the JIT
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <time.h>
 
 #include "mpc.h"
+#include "lispa.h"
 
-// If compiling on windows
+// Threads are not used on windows
 #ifdef _WIN32
-#include <string.h>
+#define LISPA_NO_THREADS
+#endif
 
-static char buffer[2048];
+#ifndef LISPA_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-// Fake readline function
-char* readline(char* prompt) {
-	fputs(prompt, stdout);
-	fgets(buffer, 2048, stdin);
-	char* cpy = malloc(strlen(buffer)+1);
-	strcpy(cpy, buffer);
-	cpy[strlen(cpy)-1] = '\0';
-	return cpy;
-}
-// Fake add_history function
-void add_history(char* unused) {}
+// The profiler samples on SIGPROF, which windows does not have
+#ifdef _WIN32
+#define LISPA_NO_PROFILE
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+// The JIT emits x86-64 code into memory from mmap
+#if !defined(__x86_64__) || defined(_WIN32)
+#define LISPA_NO_JIT
+#endif
+
+#ifndef LISPA_NO_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-// Else, include editline headers
+// deserialize maps files into memory, which windows does differently
+#ifdef _WIN32
+#define LISPA_NO_MMAP
 #else
-#include <editline/readline.h>
-// mac X does not have history file
-//#include <editline/history.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 
 // forward delcarations
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
+struct lcells;
+struct lcache;
+struct ljit;
+struct lexpansion;
+struct lvec;
+struct lmap;
+struct lsbuf;
+struct lseq;
+struct lxform;
+struct lfile;
+struct lout;
+typedef lispa_val lval;
+typedef lispa_env lenv;
+typedef struct lcells lcells;
+typedef struct lcache lcache;
+typedef struct ljit ljit;
+typedef struct lexpansion lexpansion;
+typedef struct lvec lvec;
+typedef struct lmap lmap;
+typedef struct lsbuf lsbuf;
+typedef struct lseq lseq;
+typedef struct lxform lxform;
+typedef struct lfile lfile;
+typedef struct lout lout;
 
 char* ltype_name(int type);
 
@@ -62,24 +103,41 @@ lval* lval_eval(lenv* env, lval* v);
 lval* lval_take(lval* v, int i);
 lval* lval_pop(lval* v, int i);
 void lval_del(lval* v);
-void lval_print(lval* v);
-void lval_println(lval* v);
+void lval_print(lout* out, lval* v);
+int lval_equal(lval* x, lval* y);
+int lmap_equal(lmap* x, lmap* y);
+lval* lmap_get(lmap* map, lval* key);
+void lmap_put(lmap* map, lval* key, lval* val);
+void lval_println(lout* out, lval* v);
 lval* lval_call(lenv* env, lval* func, lval* arg);
+lval* lval_copy(lval* v);
+lval* lfold_body(lenv* env, lval* formals, lval* body);
+void lfold_guard(lenv* env, lval* sym, char* func_name);
+void lfold_shadow(const char* name);
+lval* lcache_get(lenv* env, lval* k);
+void lcache_bind(lenv* env, lval* k);
+void lcache_attach(lval* func);
+void lcache_invalidate(void);
+ljit* ljit_new(void);
+void ljit_release(ljit* jit);
+lval* ljit_call(lval* func, lval* arg);
+lval* lmacro_cached(lval* v);
+lval* lmacro_call(lenv* env, lval* v, lcells* site);
+lval* lmacro_eval(lenv* env, lval* code);
+void lexpansion_del(lcells* cells);
+void lseq_release(lseq* s);
+lseq* lseq_clone(lseq* s);
+lval* lseq_take_drop(lenv* env, lval* arg, char* func_name);
+void lxform_release(lxform* xf);
+lxform* lxform_clone(lxform* xf);
+void lfile_release(lfile* f);
+lval* lfile_read_line(lfile* f);
 
 lenv* lenv_new(void);
 lenv* lenv_copy(lenv* env);
+lenv* lenv_clone(lenv* env);
 void lenv_del(lenv* env);
 
-// Parsers
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
-
 
 
 #define RED     "\x1b[31m"
@@ -98,23 +156,201 @@ struct lval {
 	long num;
 	char* err;
 	char* sym;
+	// Inline cache of a symbol in a lambda, or NULL
+	lcache* cache;
 	char* str;
+	// Length of str, which may contain null bytes
+	int str_len;
+	// Structural hash of a string, 0 until computed, see lval_hash
+	unsigned long hash;
 
 	// Function
 	lbuiltin builtin;
+	// Name a lambda was first defined with, NULL if never
+	const char* name;
 	lenv* env;
 	lval* formals;
 	lval* body;
+	// Body with constants folded, used while fold_epoch is current
+	lval* folded;
+	long fold_epoch;
+	// Call counter and compiled code shared by copies, see JIT
+	ljit* jit;
+	// Called with its arguements unevaluated, see MACROS
+	bool macro;
+	// Evaluates its arguements itself, see SPECIAL FORMS
+	bool special;
 	
 	// Expressions
 	int count;
 	// A list of lval pointers with its count
 	struct lval** cell;
+	// Storage the cells are a view of, shared between copies
+	lcells* cells;
+
+	// Vector
+	lvec* vec;
+	// Slices are views of [start, start+len) into vec.
+	// A whole vector tracks the length of vec instead.
+	bool slice;
+	int start;
+	int len;
+
+	// Hash map
+	lmap* map;
+
+	// String builder
+	lsbuf* sbuf;
+
+	// Lazy sequence
+	lseq* seq;
+
+	// Transducer
+	lxform* xform;
+
+	// File
+	lfile* file;
+};
+/*
+Storage of expression cells.
+Copies of an expression share its storage, and each one sees count
+cells from cell onwards. So head, tail, take and drop only move the
+view. Storage is changed in place only by the single expression that
+references it, see lval_own.
+*/
+struct lcells {
+	// Number of lvals referencing this storage
+	int refs;
+	// Slots in use, slots outside of the view may be NULL
+	int count;
+	int capacity;
+	lval** items;
+	// Expansion of the macro call these cells are the form of, or NULL
+	lexpansion* expansion;
+	// Structural hash of the view hash_cell, hash_count, 0 until computed
+	unsigned long hash;
+	lval** hash_cell;
+	int hash_count;
+};
+/*
+Inline cache of a symbol in a lambda, shared by the copies of the
+symbol. Remembers the global value the symbol last resolved to, see
+INLINE CACHES.
+*/
+struct lcache {
+	int refs;
+	// Global lookup version the value is valid for, 0 when never filled
+	long version;
+	// Global environment the value was found in and the value, owned by it
+	lenv* env;
+	lval* value;
+	// Whether the name was already marked as bound locally
+	bool bound;
+};
+// Compiled code of a lambda, shared by its copies, see JIT
+struct ljit {
+	int refs;
+	int state;
+	// Calls counted towards compiling and times the code gave up
+	int calls;
+	int deopts;
+	// Global environment and lookup version the state is valid for
+	lenv* env;
+	long version;
+	int nargs;
+	// Executable mapping of size bytes
+	void* code;
+	size_t size;
+};
+// Shared contiguous storage of a vector and its slices
+struct lvec {
+	// Number of lvals referencing this storage
+	int refs;
+	int count;
+	int capacity;
+	lval** items;
+};
+// Shared growable buffer of a string builder
+struct lsbuf {
+	// Number of lvals referencing this buffer
+	int refs;
+	int len;
+	int capacity;
+	char* data;
+};
+/*
+Node of a lazy sequence, shared by copies, see LAZY SEQUENCES.
+Realized nodes hold their first item and the rest, unrealized ones
+what computes them. Only one of rest and src is ever set.
+*/
+struct lseq {
+	int refs;
+	int kind;
+	// Realized: NULL first and rest at the end of the sequence
+	lval* first;
+	lseq* rest;
+	// Unrealized: function, source sequence, list or value, and counters
+	lval* func;
+	lseq* src;
+	lval* value;
+	long from;
+	long to;
+	long step;
+};
+// Stage of a transducer, see TRANSDUCERS
+typedef struct lxstage {
+	int kind;
+	// Function of a map or filter stage, count of a take stage
+	lval* func;
+	long n;
+} lxstage;
+// Stages of a transducer, shared by copies and never changed
+struct lxform {
+	int refs;
+	int count;
+	lxstage* stages;
+};
+// File open for reading, shared by copies, see FILES
+struct lfile {
+	int refs;
+	// NULL once closed
+	FILE* file;
+	// Bytes [pos, len) of buf are read but not yet used
+	char* buf;
+	int pos;
+	int len;
+};
+// Hash map entry, chained within its bucket
+typedef struct lmap_entry {
+	unsigned long hash;
+	lval* key;
+	lval* val;
+	struct lmap_entry* next;
+} lmap_entry;
+// Hash table with a power of two bucket count
+typedef struct lmap_table {
+	lmap_entry** buckets;
+	unsigned long size;
+	unsigned long used;
+} lmap_table;
+/*
+Shared storage of a hash map.
+Growing moves buckets from tables[0] to tables[1] a few at a time
+on each operation, so no single operation pays for a full rehash.
+*/
+struct lmap {
+	// Number of lvals referencing this storage
+	int refs;
+	lmap_table tables[2];
+	// Next bucket of tables[0] to move, -1 when not rehashing
+	long rehash;
 };
 // environment structure
 struct lenv {
 	lenv* parent;
 	int count;
+	// Bumped whenever a variable is put
+	int version;
 	// A list of symbols
 	char** syms;
 	// A list of values
@@ -141,6 +377,9 @@ struct lenv {
 
 /* Assertion macro for lval type  */
 #define LASSERT_TYPE(arg, index, expected_type, func_name) { \
+	LASSERT(arg, (index) < arg->count, "'%s' passed too few arguments. " \
+		"Got %i, Expected more than %i", \
+		func_name, arg->count, (int)(index)); \
 	bool cond = arg->cell[index]->type == expected_type; \
 	LASSERT(arg, cond, "'%s' passed the incorrect type. " \
 		"Got %s, Expected %s", \
@@ -157,21 +396,673 @@ struct lenv {
 }
 // lisp value types
 enum lval_types {
-	LVAL_ERR,
-	LVAL_NUM,
-	LVAL_SYM,
-	LVAL_STR,
-	LVAL_FUNC,
-	LVAL_SEXPR,
-	LVAL_QEXPR
+	LVAL_ERR = LISPA_ERR,
+	LVAL_NUM = LISPA_NUM,
+	LVAL_SYM = LISPA_SYM,
+	LVAL_STR = LISPA_STR,
+	LVAL_FUNC = LISPA_FUNC,
+	LVAL_SEXPR = LISPA_SEXPR,
+	LVAL_QEXPR = LISPA_QEXPR,
+	LVAL_VEC = LISPA_VEC,
+	LVAL_MAP = LISPA_MAP,
+	LVAL_SBUF = LISPA_SBUF,
+	LVAL_SEQ = LISPA_SEQ,
+	LVAL_XFORM = LISPA_XFORM,
+	LVAL_FILE = LISPA_FILE,
+	// Number of types
+	LVAL_TYPES
+};
+
+// OUTPUT
+
+#define LOUT_SIZE 8192
+
+// Buffered writer, flushed once per top-level print
+struct lout {
+	FILE* file;
+	// When held, prints are only flushed when the buffer fills
+	bool hold;
+	int len;
+	char buffer[LOUT_SIZE];
+};
+
+// Writer for standard output, one per thread
+lout* lout_stdout(void) {
+	static __thread lout out;
+	if (!out.file) { out.file = stdout; }
+	return &out;
+}
+
+void lout_flush(lout* out) {
+	fwrite(out->buffer, 1, out->len, out->file);
+	fflush(out->file);
+	out->len = 0;
+}
+
+// Ends a top-level print
+void lout_end(lout* out) {
+	if (!out->hold) { lout_flush(out); }
+}
+
+void lout_write(lout* out, const char* s, int len) {
+	// Large writes skip the buffer
+	if (len > LOUT_SIZE - out->len) {
+		fwrite(out->buffer, 1, out->len, out->file);
+		out->len = 0;
+		if (len >= LOUT_SIZE) {
+			fwrite(s, 1, len, out->file);
+			return;
+		}
+	}
+	memcpy(out->buffer + out->len, s, len);
+	out->len += len;
+}
+
+void lout_puts(lout* out, const char* s) {
+	lout_write(out, s, strlen(s));
+}
+
+void lout_putc(lout* out, char c) {
+	if (out->len == LOUT_SIZE) {
+		fwrite(out->buffer, 1, out->len, out->file);
+		out->len = 0;
+	}
+	out->buffer[out->len++] = c;
+}
+
+/* Formats a number into buffer, which needs 21 bytes, returns the length */
+int lfmt_num(char* buffer, long num) {
+	char digits[20];
+	int count = 0;
+	// Negate as unsigned so the most negative number works
+	unsigned long n = num < 0 ? -(unsigned long)num : (unsigned long)num;
+	do {
+		digits[count++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	int len = 0;
+	if (num < 0) { buffer[len++] = '-'; }
+	while (count) {
+		buffer[len++] = digits[--count];
+	}
+	return len;
+}
+
+void lout_num(lout* out, long num) {
+	char buffer[21];
+	lout_write(out, buffer, lfmt_num(buffer, num));
+}
+
+// STATS
+
+/*
+Counters of what the interpreter allocates, copies and looks up, built
+in with -DLISPA_STATS and costing nothing otherwise. Each thread counts
+on its own, so the counters need no locks.
+*/
+#ifdef LISPA_STATS
+
+typedef struct lstats {
+	// lvals created and deleted, by type
+	long allocs[LVAL_TYPES];
+	long frees[LVAL_TYPES];
+	// lvals reused from a context's free list
+	long reused;
+	// Nodes made by lval_copy and bytes of text and cells they copied
+	long copies;
+	long copy_bytes;
+	// Shared cells copied so an expression could change them
+	long cells_copies;
+	long env_copies;
+	// Variable lookups, environments walked and symbols compared
+	long env_lookups;
+	long env_walked;
+	long env_compares;
+	long reallocs;
+	long cache_hits;
+	long cache_misses;
+	long jit_calls;
+	long jit_deopts;
+} lstats;
+
+static __thread lstats lstats_thread;
+
+#define LSTAT(counter) (lstats_thread.counter++)
+#define LSTAT_ADD(counter, n) (lstats_thread.counter += (n))
+
+#else
+
+#define LSTAT(counter)
+#define LSTAT_ADD(counter, n)
+
+#endif
+
+// CONTEXT
+
+/*
+Interpreter context.
+Everything an interpreter changes lives here, so contexts on different
+threads share no mutable state. The thread's current context is set
+with lctx_use and is found by the allocator and by builtins.
+*/
+struct lispa_ctx {
+	// Parsers
+	mpc_parser_t* Number;
+	mpc_parser_t* Symbol;
+	mpc_parser_t* String;
+	mpc_parser_t* Comment;
+	mpc_parser_t* Sexpr;
+	mpc_parser_t* Qexpr;
+	mpc_parser_t* Expr;
+	mpc_parser_t* Lispy;
+
+	// Context the parsers belong to when they are shared
+	lispa_ctx* origin;
+
+	// Global environment
+	lenv* env;
+
+	// Freed lvals kept for reuse
+	lval* free_list;
+	int free_count;
+	// Number of lvals alive and ever allocated
+	long values;
+	long allocs;
+	// Bytes held by the strings, builders, vectors and maps alive
+	long bytes;
+
+	// Limits of each evaluation, 0 when unlimited
+	bool limited;
+	long timeout_ms;
+	long max_memory;
+	// State of the running evaluation
+	double deadline;
+	long values_start;
+	long bytes_start;
+	int steps;
+	const char* abort;
+
+	// Versions inline caches and folded bodies are current at, and the
+	// counts of names first bound locally they were last taken at
+	long cache_version;
+	long cache_binds;
+	long fold_epoch;
+	long fold_shadows;
+
+	lout out;
 };
 
+// Most freed lvals a context keeps for reuse
+#define LCTX_FREE_MAX 65536
+
+// Context of this thread, NULL on threads without one
+static __thread lispa_ctx* lctx = NULL;
+
+/* Makes ctx the context of this thread, returns the previous one */
+lispa_ctx* lctx_use(lispa_ctx* ctx) {
+	lispa_ctx* previous = lctx;
+	lctx = ctx;
+	return previous;
+}
+
+/* Writer for the output of this thread's context */
+lout* lctx_out(void) {
+	return lctx ? &lctx->out : lout_stdout();
+}
+
+double lctx_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Versions handed out to contexts so far
+static long lctx_versions = 0;
+
+/* A version number no context has had before */
+long lctx_version(void) {
+	return __atomic_add_fetch(&lctx_versions, 1, __ATOMIC_RELAXED);
+}
+
+/* Parsers are only read while parsing, so clone can share those of ctx */
+void lctx_share_parsers(lispa_ctx* clone, lispa_ctx* ctx) {
+	clone->origin = ctx->origin ? ctx->origin : ctx;
+	clone->Number = ctx->Number;
+	clone->Symbol = ctx->Symbol;
+	clone->String = ctx->String;
+	clone->Comment = ctx->Comment;
+	clone->Sexpr = ctx->Sexpr;
+	clone->Qexpr = ctx->Qexpr;
+	clone->Expr = ctx->Expr;
+	clone->Lispy = ctx->Lispy;
+}
+
+/* Makes ctx current for an evaluation from the API and starts its limits */
+lispa_ctx* lctx_enter(lispa_ctx* ctx) {
+	ctx->abort = NULL;
+	ctx->steps = 0;
+	ctx->values_start = ctx->values;
+	ctx->bytes_start = ctx->bytes;
+	if (ctx->timeout_ms) {
+		ctx->deadline = lctx_now() + ctx->timeout_ms / 1000.0;
+	}
+	return lctx_use(ctx);
+}
+
+/* Bytes of memory ctx has taken since its evaluation started */
+long lctx_used(lispa_ctx* ctx) {
+	return (ctx->values - ctx->values_start) * (long)sizeof(lval)
+		+ ctx->bytes - ctx->bytes_start;
+}
+
+/*
+Checks the limits of this thread's context, returns the reason to stop
+or NULL. Once a limit is hit every evaluation stops until the next one
+from the API, so builtins ignoring errors unwind quickly too.
+*/
+const char* lctx_limit(void) {
+	if (lctx->abort) { return lctx->abort; }
+	if (lctx->max_memory && lctx_used(lctx) > lctx->max_memory) {
+		lctx->abort = "Memory limit reached";
+	}
+	// Reading the clock is slow, so only every 1024 steps
+	if (lctx->timeout_ms && (++lctx->steps & 1023) == 0 && lctx_now() > lctx->deadline) {
+		lctx->abort = "Evaluation timed out";
+	}
+	return lctx->abort;
+}
+
+/* Whether a limit of this thread's context stops what is running */
+bool lctx_stopped(void) {
+	return lctx && lctx->limited && lctx_limit();
+}
+
+/*
+Counts n more bytes held by values of this thread's context, fewer when
+n is negative. Going over the memory limit stops the evaluation at its
+next step, so one builtin can't build a value many times the limit.
+*/
+void lctx_bytes(long n) {
+	if (!lctx) { return; }
+	lctx->bytes += n;
+	if (n > 0 && lctx->max_memory && !lctx->abort
+		&& lctx_used(lctx) > lctx->max_memory) {
+		lctx->abort = "Memory limit reached";
+	}
+}
+
+/*
+Allocates an lval, reusing one freed in this thread's context.
+The free list links through the first bytes of each freed lval.
+*/
+lval* lval_alloc(void) {
+	if (lctx) {
+		lctx->values++;
+		lctx->allocs++;
+	}
+	if (lctx && lctx->free_list) {
+		LSTAT(reused);
+		lval* v = lctx->free_list;
+		lctx->free_list = *(lval**)v;
+		lctx->free_count--;
+		v->hash = 0;
+		return v;
+	}
+	lval* v = malloc(sizeof(lval));
+	v->hash = 0;
+	return v;
+}
+
+void lval_free(lval* v) {
+	if (lctx) { lctx->values--; }
+	if (lctx && lctx->free_count < LCTX_FREE_MAX) {
+		*(lval**)v = lctx->free_list;
+		lctx->free_list = v;
+		lctx->free_count++;
+		return;
+	}
+	free(v);
+}
+
+// SYMBOLS
+
+/*
+Symbols and function names, interned so each name is stored once and
+values hold it by pointer. Copying a symbol shares its name and two
+symbols are equal when their names are the same pointer. Names are
+never freed, they are few and shared by every context. Inline caches
+also mark here which names were ever bound outside a global environment.
+*/
+typedef struct lname {
+	struct lname* next;
+	unsigned long hash;
+	bool bound;
+	char name[];
+} lname;
+
+// Buckets the table starts with, doubled whenever it is twice as full
+#define LNAME_BUCKETS 256
+
+static lname** lnames = NULL;
+static unsigned long lnames_size = 0;
+static unsigned long lnames_count = 0;
+// Interned "&", set when the first name is interned
+static const char* lname_rest = NULL;
+#ifndef LISPA_NO_THREADS
+static pthread_mutex_t lnames_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Moves every entry into a table of twice the buckets, with lnames_lock held
+void lname_grow(void) {
+	unsigned long size = lnames_size ? lnames_size * 2 : LNAME_BUCKETS;
+	lname** buckets = calloc(size, sizeof(lname*));
+	for (unsigned long i = 0; i < lnames_size; i++) {
+		lname* entry = lnames[i];
+		while (entry) {
+			lname* next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(lnames);
+	lnames = buckets;
+	lnames_size = size;
+}
+
+// Finds or adds the entry of name, with lnames_lock held
+lname* lname_find(const char* name) {
+	unsigned long hash = 5381;
+	for (const char* c = name; *c; c++) { hash = hash * 33 + (unsigned char)*c; }
+	if (!lnames) {
+		lname_grow();
+		lname_rest = lname_find("&")->name;
+	}
+	if (lnames_count >= lnames_size * 2) { lname_grow(); }
+	lname** bucket = &lnames[hash & (lnames_size - 1)];
+
+	lname* entry = *bucket;
+	while (entry && (entry->hash != hash || strcmp(entry->name, name) != 0)) {
+		entry = entry->next;
+	}
+	if (!entry) {
+		entry = malloc(sizeof(lname) + strlen(name) + 1);
+		strcpy(entry->name, name);
+		entry->hash = hash;
+		entry->bound = false;
+		entry->next = *bucket;
+		*bucket = entry;
+		lnames_count++;
+	}
+	return entry;
+}
+
+const char* lname_intern(const char* name) {
+#ifndef LISPA_NO_THREADS
+	pthread_mutex_lock(&lnames_lock);
+#endif
+	lname* entry = lname_find(name);
+#ifndef LISPA_NO_THREADS
+	pthread_mutex_unlock(&lnames_lock);
+#endif
+	return entry->name;
+}
+
+// Entry of a name returned by lname_intern
+lname* lname_entry(const char* name) {
+	return (lname*)(name - offsetof(lname, name));
+}
+
+/* Marks an interned name as bound outside a global environment, true if it wasn't */
+bool lname_bind(const char* name) {
+	return !__atomic_exchange_n(&lname_entry(name)->bound, true, __ATOMIC_RELAXED);
+}
+
+bool lname_bound(const char* name) {
+	return __atomic_load_n(&lname_entry(name)->bound, __ATOMIC_RELAXED);
+}
+
+// PROFILER
+
+/*
+While profiling, each thread keeps a shadow stack of the names of the
+lambdas it is calling. A SIGPROF timer interrupts whichever thread is
+using the CPU, and the handler copies that thread's stack into storage
+allocated up front, since a signal handler must not allocate. A sample
+is stored as its depth followed by the names, outermost first.
+*/
+
+// Deepest frames kept, deeper calls are counted in their caller
+#define LPROF_DEPTH 256
+// Slots for samples, names plus one depth slot per sample
+#define LPROF_SLOTS (1 << 21)
+
+typedef struct lprof_stack {
+	volatile int depth;
+	const char* volatile names[LPROF_DEPTH];
+} lprof_stack;
+
+static volatile int lprof_on = 0;
+static __thread lprof_stack lprof_thread;
+
+static struct {
+	int hz;
+	const char** slots;
+	long used;
+	long samples;
+	long dropped;
+} lprof;
+
+void lprof_push(const char* name) {
+	lprof_stack* stack = &lprof_thread;
+	if (stack->depth < LPROF_DEPTH) { stack->names[stack->depth] = name; }
+	stack->depth++;
+}
+
+void lprof_pop(void) {
+	lprof_thread.depth--;
+}
+
+#ifndef LISPA_NO_PROFILE
+
+void lprof_sample(int sig) {
+	if (!lprof_on) { return; }
+	lprof_stack* stack = &lprof_thread;
+	long depth = stack->depth < LPROF_DEPTH ? stack->depth : LPROF_DEPTH;
+	// Reserve slots, threads may be sampled at once
+	long at = __atomic_fetch_add(&lprof.used, depth + 1, __ATOMIC_RELAXED);
+	if (at + depth + 1 > LPROF_SLOTS) {
+		__atomic_fetch_add(&lprof.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	lprof.slots[at] = (const char*)depth;
+	for (long i = 0; i < depth; i++) {
+		lprof.slots[at + 1 + i] = stack->names[i];
+	}
+	__atomic_fetch_add(&lprof.samples, 1, __ATOMIC_RELAXED);
+}
+
+int lispa_profile_start(int hz) {
+	if (hz <= 0) { hz = 1000; }
+	lprof.hz = hz;
+	lprof.slots = malloc(sizeof(char*) * LPROF_SLOTS);
+	lprof.used = 0;
+	lprof.samples = 0;
+	lprof.dropped = 0;
+	lprof_on = 1;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = lprof_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+	return 1;
+}
+
+#else
+
+int lispa_profile_start(int hz) {
+	return 0;
+}
+
+#endif
+
+// Stored samples, located by the slot their depth is in
+typedef struct lprof_sample_at {
+	long depth;
+	const char** names;
+} lprof_sample_at;
+
+int lprof_compare(const void* a, const void* b) {
+	const lprof_sample_at* x = a;
+	const lprof_sample_at* y = b;
+	long depth = x->depth < y->depth ? x->depth : y->depth;
+	for (long i = 0; i < depth; i++) {
+		if (x->names[i] != y->names[i]) {
+			return strcmp(x->names[i] ? x->names[i] : "",
+				y->names[i] ? y->names[i] : "");
+		}
+	}
+	return (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+// Self and total samples of a function
+typedef struct lprof_func {
+	const char* name;
+	long self;
+	long total;
+	// Last sample counted in total, so recursion counts once
+	long last;
+} lprof_func;
+
+int lprof_compare_func(const void* a, const void* b) {
+	const lprof_func* x = a;
+	const lprof_func* y = b;
+	if (x->self != y->self) { return (x->self < y->self) - (x->self > y->self); }
+	return (x->total < y->total) - (x->total > y->total);
+}
+
+#define LPROF_NAME(name) ((name) ? (name) : "lambda")
+
+void lispa_profile_stop(FILE* folded, FILE* report) {
+	if (!lprof.slots) { return; }
+#ifndef LISPA_NO_PROFILE
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+#endif
+	lprof_on = 0;
+
+	// Locate the samples
+	long count = lprof.samples;
+	lprof_sample_at* samples = malloc(sizeof(lprof_sample_at) * (count + 1));
+	long at = 0;
+	for (long i = 0; i < count; i++) {
+		samples[i].depth = (long)lprof.slots[at];
+		samples[i].names = lprof.slots + at + 1;
+		at += samples[i].depth + 1;
+	}
+
+	if (folded) {
+		// Equal stacks end up next to each other, one line for each
+		qsort(samples, count, sizeof(lprof_sample_at), lprof_compare);
+		for (long i = 0; i < count;) {
+			long j = i + 1;
+			while (j < count && lprof_compare(&samples[i], &samples[j]) == 0) { j++; }
+			fputs("lispa", folded);
+			for (long k = 0; k < samples[i].depth; k++) {
+				fprintf(folded, ";%s", LPROF_NAME(samples[i].names[k]));
+			}
+			fprintf(folded, " %li\n", j - i);
+			i = j;
+		}
+	}
+
+	if (report) {
+		// Functions are few, so they are found with a linear search
+		int funcs_count = 0;
+		int funcs_capacity = 16;
+		lprof_func* funcs = malloc(sizeof(lprof_func) * funcs_capacity);
+		for (long i = 0; i < count; i++) {
+			// Outside of any lambda is counted as lispa
+			long depth = samples[i].depth;
+			for (long k = -1; k < depth; k++) {
+				const char* name = k < 0 ? "lispa" : LPROF_NAME(samples[i].names[k]);
+				int f = 0;
+				while (f < funcs_count && strcmp(funcs[f].name, name) != 0) { f++; }
+				if (f == funcs_count) {
+					if (funcs_count == funcs_capacity) {
+						funcs_capacity *= 2;
+						funcs = realloc(funcs, sizeof(lprof_func) * funcs_capacity);
+					}
+					funcs[f].name = name;
+					funcs[f].self = 0;
+					funcs[f].total = 0;
+					funcs[f].last = -1;
+					funcs_count++;
+				}
+				if (funcs[f].last != i) {
+					funcs[f].total++;
+					funcs[f].last = i;
+				}
+				if (k == depth - 1) { funcs[f].self++; }
+			}
+		}
+		qsort(funcs, funcs_count, sizeof(lprof_func), lprof_compare_func);
+
+		fprintf(report, "%li samples at %i Hz", count, lprof.hz);
+		if (lprof.dropped) { fprintf(report, ", %li dropped", lprof.dropped); }
+		fprintf(report, "\n   self%%  total%%  function\n");
+		for (int f = 0; f < funcs_count; f++) {
+			fprintf(report, "%7.1f%% %6.1f%%  %s\n",
+				100.0 * funcs[f].self / count, 100.0 * funcs[f].total / count,
+				funcs[f].name);
+		}
+		free(funcs);
+	}
+
+	free(samples);
+	free(lprof.slots);
+	lprof.slots = NULL;
+}
+
+// Names folding relies on first bound as a formal, in any context
+static long lfold_shadows = 0;
+
+/*
+Fold epoch of this thread's context, see FOLDING. 0 without a context,
+which no folded body is current at.
+*/
+long lfold_epoch_now(void) {
+	if (!lctx) { return 0; }
+	long shadows = __atomic_load_n(&lfold_shadows, __ATOMIC_RELAXED);
+	if (lctx->fold_shadows != shadows) {
+		lctx->fold_shadows = shadows;
+		lctx->fold_epoch = lctx_version();
+	}
+	return lctx->fold_epoch;
+}
+
+/* Whether the folded body of func is current */
+bool lfold_current(lval* func) {
+	return func->folded && func->fold_epoch && func->fold_epoch == lfold_epoch_now();
+}
+
 // LVAL TYPES CONSTRUCTORS
 
 /* Constructor for number lval pointer. Converts long to lval number. */
 lval* lval_num(long num) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_NUM;
+	LSTAT(allocs[LVAL_NUM]);
 	v->num = num;
 	return v;
 }
@@ -181,8 +1072,9 @@ Converts int long to lval error.
 */
 lval* lval_err(char* fmt, ...) {
 	// Alocate memory for lval pointer
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_ERR;
+	LSTAT(allocs[LVAL_ERR]);
 
 	// Create and initialize va list
 	va_list va;
@@ -195,6 +1087,7 @@ lval* lval_err(char* fmt, ...) {
 	vsnprintf(v->err, 511, fmt, va);
 
 	// Reallocate to used bytes
+	LSTAT(reallocs);
 	v->err = realloc(v->err, strlen(v->err) + 1);
 
 	// Cleanup va list
@@ -205,45 +1098,59 @@ lval* lval_err(char* fmt, ...) {
 Constructor for symbol lval pointer
 Converts a string symbol to a lval symbol
 */
-lval* lval_sym(char* s) {
+/* Symbol of a name already returned by lname_intern */
+lval* lval_sym_interned(const char* name) {
 	// Alocate memory for lval pointer
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
-	// Copies the string s to v->sym
-	strcpy(v->sym, s);
+	LSTAT(allocs[LVAL_SYM]);
+	v->cache = NULL;
+	v->sym = (char*)name;
 	return v;
 }
+lval* lval_sym(char* s) {
+	return lval_sym_interned(lname_intern(s));
+}
 /* Constructor for s-expression lval */
 lval* lval_sexpr(void) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_SEXPR;
+	LSTAT(allocs[LVAL_SEXPR]);
 	v->count = 0;
 	v->cell = NULL;
+	v->cells = NULL;
 	return v;
 }
 /* Constructor for q-expression lval */
 lval* lval_qexpr(void) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_QEXPR;
+	LSTAT(allocs[LVAL_QEXPR]);
 	v->count = 0;
 	v->cell = NULL;
+	v->cells = NULL;
 	return v;
 }
 /* Builtin function constructor */
 lval* lval_func(lbuiltin builtin) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_FUNC;
+	LSTAT(allocs[LVAL_FUNC]);
 	v->builtin = builtin;
+	v->name = NULL;
+	v->macro = false;
+	v->special = false;
 	return v;
 }
 // User-defined function
 lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_FUNC;
+	LSTAT(allocs[LVAL_FUNC]);
 
 	// Set builtin to null since function is user-defined
 	v->builtin = NULL;
+	v->name = NULL;
 
 	// Create new environment 
 	v->env = lenv_new();
@@ -251,61 +1158,369 @@ lval* lval_lambda(lval* formals, lval* body) {
 	// Set formals and body
 	v->formals = formals;
 	v->body = body;
+	v->folded = NULL;
+	v->fold_epoch = 0;
+	v->jit = NULL;
+	v->macro = false;
+	v->special = false;
 	return v;
 }
 
-lval* lval_str(char* string) {
-	lval* v = malloc(sizeof(lval));
+/* Constructor for a string lval that takes ownership of len bytes of string */
+lval* lval_str_take(char* string, int len) {
+	lval* v = lval_alloc();
 	v->type = LVAL_STR;
-	v->str = malloc(strlen(string) + 1);
-	strcpy(v->str, string);
+	LSTAT(allocs[LVAL_STR]);
+	v->str = string;
+	v->str_len = len;
+	lctx_bytes(len + 1);
+	return v;
+}
+/* Constructor for a string lval copying len bytes of string */
+lval* lval_str_len(char* string, int len) {
+	char* str = malloc(len + 1);
+	memcpy(str, string, len);
+	str[len] = '\0';
+	return lval_str_take(str, len);
+}
+lval* lval_str(char* string) {
+	return lval_str_len(string, strlen(string));
+}
+/* Constructor for a string builder lval holding a copy of string */
+lval* lval_sbuf(char* string, int len) {
+	lval* v = lval_alloc();
+	v->type = LVAL_SBUF;
+	LSTAT(allocs[LVAL_SBUF]);
+	v->sbuf = malloc(sizeof(lsbuf));
+	v->sbuf->refs = 1;
+	v->sbuf->len = len;
+	v->sbuf->capacity = len < 64 ? 64 : len;
+	v->sbuf->data = malloc(v->sbuf->capacity + 1);
+	lctx_bytes(v->sbuf->capacity + 1);
+	memcpy(v->sbuf->data, string, len);
+	v->sbuf->data[len] = '\0';
 	return v;
 }
+// Appends len bytes of string to a string builder
+void lval_sbuf_add(lval* v, char* string, int len) {
+	lsbuf* sbuf = v->sbuf;
+	if (sbuf->len + len > sbuf->capacity) {
+		// Grow geometrically so appends are amortized O(1)
+		int capacity = sbuf->capacity;
+		while (sbuf->len + len > sbuf->capacity) {
+			sbuf->capacity *= 2;
+		}
+		lctx_bytes(sbuf->capacity - capacity);
+		LSTAT(reallocs);
+		sbuf->data = realloc(sbuf->data, sbuf->capacity + 1);
+	}
+	memcpy(sbuf->data + sbuf->len, string, len);
+	sbuf->len += len;
+	sbuf->data[sbuf->len] = '\0';
+}
 
-lval* lval_copy(lval* v) {
-	lval* copy = malloc(sizeof(lval));
-	copy->type = v->type;
-	
-	switch (v->type) {
-		case LVAL_FUNC: 
-			// If a builtin funciton
-			if (v->builtin) {
-				copy->builtin = v->builtin; 
-			}
-			// If a user-defined function
-			else {
-				copy->builtin = NULL;
+// EXPRESSION CELLS
+
+lcells* lcells_new(int capacity) {
+	lcells* cells = malloc(sizeof(lcells));
+	cells->refs = 1;
+	cells->count = 0;
+	cells->capacity = capacity;
+	cells->items = malloc(sizeof(lval*) * capacity);
+	cells->expansion = NULL;
+	cells->hash = 0;
+	cells->hash_cell = NULL;
+	cells->hash_count = 0;
+	return cells;
+}
+/* Hash cached on the cells v views, 0 when none is */
+unsigned long lval_cells_hash(lval* v) {
+	lcells* cells = v->cells;
+	if (!cells || cells->hash_cell != v->cell || cells->hash_count != v->count) {
+		return 0;
+	}
+	return cells->hash;
+}
+// Drops a reference to cells, freeing them when it was the last one
+void lcells_release(lcells* cells) {
+	if (--cells->refs > 0) { return; }
+	if (cells->expansion) { lexpansion_del(cells); }
+	for (int i = 0; i < cells->count; i++) {
+		if (cells->items[i]) {
+			lval_del(cells->items[i]);
+		}
+	}
+	free(cells->items);
+	free(cells);
+}
+// Releases the storage of an expression once it views no cells
+void lval_release_empty(lval* v) {
+	if (v->count == 0 && v->cells) {
+		lcells_release(v->cells);
+		v->cells = NULL;
+		v->cell = NULL;
+	}
+}
+/*
+Makes v the only reference to all of its storage so the cells can be
+changed in place. Shared storage is copied, which is cheap because the
+copied cells share their own storage in turn.
+*/
+void lval_own(lval* v) {
+	lcells* cells = v->cells;
+	if (!cells) { return; }
+
+	if (cells->refs == 1) {
+		// Owned cells are about to change
+		cells->hash = 0;
+		if (v->cell == cells->items && v->count == cells->count) { return; }
+		// Delete the slots outside of the view and move the view to the front
+		int start = v->cell - cells->items;
+		for (int i = 0; i < cells->count; i++) {
+			if ((i < start || i >= start + v->count) && cells->items[i]) {
+				lval_del(cells->items[i]);
+			}
+		}
+		memmove(cells->items, v->cell, sizeof(lval*) * v->count);
+		cells->count = v->count;
+		v->cell = cells->items;
+		return;
+	}
+
+	LSTAT(cells_copies);
+	LSTAT_ADD(copy_bytes, sizeof(lval*) * v->count);
+	lcells* own = lcells_new(v->count);
+	for (int i = 0; i < v->count; i++) {
+		own->items[i] = lval_copy(v->cell[i]);
+	}
+	own->count = v->count;
+	cells->refs--;
+	v->cells = own;
+	v->cell = own->items;
+}
+// Narrows v to its first n cells
+void lval_truncate(lval* v, int n) {
+	if (n >= v->count) { return; }
+	// Nothing else can see the cells when the storage is not shared
+	if (v->cells->refs == 1) {
+		v->cells->hash = 0;
+		for (int i = n; i < v->count; i++) {
+			lval_del(v->cell[i]);
+			v->cell[i] = NULL;
+		}
+	}
+	v->count = n;
+	lval_release_empty(v);
+}
+/*
+Makes room for n cells in front of the view of v, whose storage must
+not be shared. The room grows with the list, so prepending to it one
+cell at a time is amortized constant.
+*/
+void lval_reserve_front(lval* v, int n) {
+	lcells* cells = v->cells;
+	int start = v->cell - cells->items;
+	if (start >= n) { return; }
+
+	int front = n + v->count;
+	lval** items = malloc(sizeof(lval*) * (front + v->count));
+	for (int i = 0; i < front; i++) { items[i] = NULL; }
+	memcpy(items + front, v->cell, sizeof(lval*) * v->count);
+	// Nothing else can see the slots outside of the view
+	for (int i = 0; i < cells->count; i++) {
+		if ((i < start || i >= start + v->count) && cells->items[i]) {
+			lval_del(cells->items[i]);
+		}
+	}
+	free(cells->items);
+	cells->items = items;
+	cells->hash = 0;
+	cells->count = front + v->count;
+	cells->capacity = cells->count;
+	v->cell = items + front;
+}
+// Narrows v to drop its first n cells
+void lval_drop(lval* v, int n) {
+	if (n > v->count) { n = v->count; }
+	if (v->cells && v->cells->refs == 1) {
+		v->cells->hash = 0;
+		for (int i = 0; i < n; i++) {
+			lval_del(v->cell[i]);
+			v->cell[i] = NULL;
+		}
+	}
+	v->cell += n;
+	v->count -= n;
+	lval_release_empty(v);
+}
+
+/* Constructor for an empty vector lval */
+lval* lval_vec(void) {
+	lval* v = lval_alloc();
+	v->type = LVAL_VEC;
+	LSTAT(allocs[LVAL_VEC]);
+	v->vec = malloc(sizeof(lvec));
+	v->vec->refs = 1;
+	v->vec->count = 0;
+	v->vec->capacity = 0;
+	v->vec->items = NULL;
+	v->slice = false;
+	v->start = 0;
+	v->len = 0;
+	return v;
+}
+// Number of elements visible through a vector or slice
+int lval_vec_len(lval* v) {
+	return v->slice ? v->len : v->vec->count;
+}
+// First element visible through a vector or slice
+lval** lval_vec_items(lval* v) {
+	return v->vec->items + v->start;
+}
+// Appends a value to the end of a vector's storage
+void lval_vec_push(lval* v, lval* x) {
+	lvec* vec = v->vec;
+	if (vec->count == vec->capacity) {
+		// Double the capacity so pushes are amortized O(1)
+		int capacity = vec->capacity;
+		vec->capacity = vec->capacity ? vec->capacity * 2 : 8;
+		lctx_bytes(sizeof(lval*) * (vec->capacity - capacity));
+		LSTAT(reallocs);
+		vec->items = realloc(vec->items, sizeof(lval*) * vec->capacity);
+	}
+	vec->items[vec->count++] = x;
+}
+
+/* Constructor for an empty hash map lval */
+lval* lval_map(void) {
+	lval* v = lval_alloc();
+	v->type = LVAL_MAP;
+	LSTAT(allocs[LVAL_MAP]);
+	v->map = calloc(1, sizeof(lmap));
+	v->map->refs = 1;
+	v->map->rehash = -1;
+	return v;
+}
+
+/* Constructor for a lazy sequence lval, taking over a reference to s */
+lval* lval_seq(lseq* s) {
+	lval* v = lval_alloc();
+	v->type = LVAL_SEQ;
+	LSTAT(allocs[LVAL_SEQ]);
+	v->seq = s;
+	return v;
+}
+
+/* Constructor for a transducer lval, taking over a reference to xf */
+lval* lval_xform(lxform* xf) {
+	lval* v = lval_alloc();
+	v->type = LVAL_XFORM;
+	LSTAT(allocs[LVAL_XFORM]);
+	v->xform = xf;
+	return v;
+}
+
+/* Constructor for a file lval, taking over a reference to f */
+lval* lval_file(lfile* f) {
+	lval* v = lval_alloc();
+	v->type = LVAL_FILE;
+	LSTAT(allocs[LVAL_FILE]);
+	v->file = f;
+	return v;
+}
+
+lval* lval_copy(lval* v) {
+	lval* copy = lval_alloc();
+	copy->type = v->type;
+	LSTAT(allocs[v->type]);
+	LSTAT(copies);
+	
+	switch (v->type) {
+		case LVAL_FUNC: 
+			// If a builtin funciton
+			copy->name = v->name;
+			copy->macro = v->macro;
+			copy->special = v->special;
+			if (v->builtin) {
+				copy->builtin = v->builtin; 
+			}
+			// If a user-defined function
+			else {
+				copy->builtin = NULL;
 				copy->env = lenv_copy(v->env);
 				copy->formals = lval_copy(v->formals);
 				copy->body = lval_copy(v->body);
+				copy->folded = v->folded ? lval_copy(v->folded) : NULL;
+				copy->fold_epoch = v->fold_epoch;
+				copy->jit = v->jit;
+				if (copy->jit) { copy->jit->refs++; }
 			}
 			break;
 		
 		case LVAL_NUM: copy->num = v->num; break;
 		case LVAL_SYM:
-			// Allocate memory
-			copy->sym = malloc(strlen(v->sym) + 1);
-			// Copy v symbol to the copy's
-			strcpy(copy->sym, v->sym);
+			// Names are interned, so copies share them
+			copy->sym = v->sym;
+			// Copies of a symbol share its cache
+			copy->cache = v->cache;
+			if (copy->cache) { copy->cache->refs++; }
 			break;
 		case LVAL_STR:
-			copy->str = malloc(strlen(v->str) + 1);
-			strcpy(copy->str, v->str);
+			copy->str = malloc(v->str_len + 1);
+			memcpy(copy->str, v->str, v->str_len + 1);
+			copy->str_len = v->str_len;
+			copy->hash = v->hash;
+			lctx_bytes(v->str_len + 1);
+			LSTAT_ADD(copy_bytes, v->str_len + 1);
+			break;
+		case LVAL_SBUF:
+			// Builders are shared like vectors
+			copy->sbuf = v->sbuf;
+			copy->sbuf->refs++;
 			break;
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
+			// Share the cells instead of copying them
 			copy->count = v->count;
-			copy->cell = malloc(sizeof(lval*) * copy->count);
-			
-			for (int i = 0; i < copy->count; i++) {
-				copy->cell[i] = lval_copy(v->cell[i]);
+			copy->cell = v->cell;
+			copy->cells = v->cells;
+			if (copy->cells) {
+				copy->cells->refs++;
 			}
 			break;
+		case LVAL_VEC:
+			// Vectors are shared, only the view is copied
+			copy->vec = v->vec;
+			copy->vec->refs++;
+			copy->slice = v->slice;
+			copy->start = v->start;
+			copy->len = v->len;
+			break;
+		case LVAL_MAP:
+			// Maps are shared like vectors
+			copy->map = v->map;
+			copy->map->refs++;
+			break;
+		case LVAL_SEQ:
+			// Sequences share their nodes, so items are computed once
+			copy->seq = v->seq;
+			copy->seq->refs++;
+			break;
+		case LVAL_XFORM:
+			copy->xform = v->xform;
+			copy->xform->refs++;
+			break;
+		case LVAL_FILE:
+			// Files are shared, reading through one copy moves them all on
+			copy->file = v->file;
+			copy->file->refs++;
+			break;
 		case LVAL_ERR:
 			// Allocate memory
 			copy->err = malloc(strlen(v->err) + 1);
 			// Copy v error message to the copy's
 			strcpy(copy->err, v->err);
+			LSTAT_ADD(copy_bytes, strlen(v->err) + 1);
 			break;
 	}
 	return copy;
@@ -322,28 +1537,77 @@ void lval_del(lval* v) {
 				lenv_del(v->env);
 				lval_del(v->formals);
 				lval_del(v->body);
+				if (v->folded) { lval_del(v->folded); }
+				if (v->jit) { ljit_release(v->jit); }
 			}
 			break;
 		case LVAL_ERR: free(v->err); break;
-		case LVAL_SYM: free(v->sym); break;
-		case LVAL_STR: free(v->str); break;
+		case LVAL_SYM:
+			if (v->cache && --v->cache->refs == 0) { free(v->cache); }
+			break;
+		case LVAL_STR:
+			lctx_bytes(-(v->str_len + 1));
+			free(v->str);
+			break;
+		case LVAL_SBUF:
+			if (--v->sbuf->refs == 0) {
+				lctx_bytes(-(v->sbuf->capacity + 1));
+				free(v->sbuf->data);
+				free(v->sbuf);
+			}
+			break;
 		case LVAL_QEXPR:
 		case LVAL_SEXPR:
-			// Free all elements in s expression
-			for (int i = 0; i < v->count; i++) {
-				lval_del(v->cell[i]);
+			// Free the cells if nothing else shares them
+			if (v->cells) {
+				lcells_release(v->cells);
+			}
+			break;
+		case LVAL_VEC:
+			// Free the storage once nothing references it
+			if (--v->vec->refs == 0) {
+				for (int i = 0; i < v->vec->count; i++) {
+					lval_del(v->vec->items[i]);
+				}
+				lctx_bytes(-(long)sizeof(lval*) * v->vec->capacity);
+				free(v->vec->items);
+				free(v->vec);
+			}
+			break;
+		case LVAL_MAP:
+			if (--v->map->refs == 0) {
+				for (int t = 0; t < 2; t++) {
+					lmap_table* table = &v->map->tables[t];
+					for (unsigned long i = 0; i < table->size; i++) {
+						lmap_entry* entry = table->buckets[i];
+						while (entry) {
+							lmap_entry* next = entry->next;
+							lval_del(entry->key);
+							lval_del(entry->val);
+							free(entry);
+							entry = next;
+						}
+					}
+					lctx_bytes(-(long)(sizeof(lmap_entry) * table->used
+						+ sizeof(lmap_entry*) * table->size));
+					free(table->buckets);
+				}
+				free(v->map);
 			}
-			// And the container of the pointer
-			free(v->cell);
 			break;
+		case LVAL_SEQ: lseq_release(v->seq); break;
+		case LVAL_XFORM: lxform_release(v->xform); break;
+		case LVAL_FILE: lfile_release(v->file); break;
 	}
-	free(v);
+	LSTAT(frees[v->type]);
+	lval_free(v);
 }
 // ENVIRONMENT functions
 // Create a new environment
 lenv* lenv_new(void) {
 	lenv* env = malloc(sizeof(lenv));
 	env->parent = NULL;
+	env->version = 0;
 	env->count = 0;
 	env->syms = NULL;
 	env->vals = NULL;
@@ -351,45 +1615,48 @@ lenv* lenv_new(void) {
 }
 
 lenv* lenv_copy(lenv* env) {
+	LSTAT(env_copies);
 	lenv* copy = malloc(sizeof(lenv));
 	copy->parent = env->parent;
+	copy->version = 0;
 	copy->count = env->count;
 
 	copy->syms = malloc(sizeof(char*) * copy->count);
 	copy->vals = malloc(sizeof(lval*) * copy->count);
 	
 	for (int i = 0; i < env->count; i++) {
-		// Copy symbols and values
-		copy->syms[i] = malloc(strlen(env->syms[i]) + 1);
-		strcpy(copy->syms[i], env->syms[i]);
+		// Symbols are interned and shared, values copied
+		copy->syms[i] = env->syms[i];
 		copy->vals[i] = lval_copy(env->vals[i]);
 	}
 	return copy;
 }
 
 lval* lenv_get(lenv* env, lval* k) {
-	for (int i = 0; i < env->count; i++) {
-		// If the stored symbol string matches k's symbol string
-		if (strcmp(env->syms[i], k->sym) == 0) {
-			// Return a copy of the value
-			return lval_copy(env->vals[i]);
+	LSTAT(env_lookups);
+	// Walk up the environment and its parents
+	for (; env; env = env->parent) {
+		LSTAT(env_walked);
+		for (int i = 0; i < env->count; i++) {
+			LSTAT(env_compares);
+			// Symbols are interned, so the same name is the same pointer
+			if (env->syms[i] == k->sym) {
+				// Return a copy of the value
+				return lval_copy(env->vals[i]);
+			}
 		}
 	}
-	// If there is a parent environment
-	if (env->parent) {
-		return lenv_get(env->parent, k);
-	} 
 	// Otherwise, no symbol was found and return error
-	else {
-		return lval_err("Unbound symbol! %s", k->sym);
-	}
+	return lval_err("Unbound symbol! %s", k->sym);
 }
 
 void lenv_put(lenv* env, lval* k, lval* v) {
+	env->version++;
+	lcache_bind(env, k);
 	// Check entire environment for duplicate variable
 	for (int i = 0; i < env->count; i++) {
 		// If variable is already in environment
-		if (strcmp(env->syms[i], k->sym) == 0) {
+		if (env->syms[i] == k->sym) {
 			// Delete found variable
 			lval_del(env->vals[i]);
 			// Replace with v variable
@@ -400,13 +1667,13 @@ void lenv_put(lenv* env, lval* k, lval* v) {
 	// If it does not exsist, create new entry
 	env->count++;
 	// Allocate memory for new entry
+	LSTAT_ADD(reallocs, 2);
 	env->vals = realloc(env->vals, sizeof(lval*) * env->count);
 	env->syms = realloc(env->syms, sizeof(char*) * env->count);
 	
 	// Copy lval and symbol into environment
 	env->vals[env->count-1] = lval_copy(v);
-	env->syms[env->count-1] = malloc(strlen(k->sym) + 1);
-	strcpy(env->syms[env->count-1], k->sym);
+	env->syms[env->count-1] = k->sym;
 }
 
 void lenv_def(lenv* env, lval* k, lval* v) {
@@ -419,21 +1686,139 @@ void lenv_def(lenv* env, lval* k, lval* v) {
 }
 void lenv_del(lenv* e) {
 	for (int i = 0; i < e->count; i++) {
-		free(e->syms[i]);
 		lval_del(e->vals[i]);
 	}
 	free(e->syms);
 	free(e->vals);
 	free(e);
 }
+// Deletes an environment and all of its parents
+void lenv_del_chain(lenv* e) {
+	while (e) {
+		lenv* parent = e->parent;
+		lenv_del(e);
+		e = parent;
+	}
+}
+
+// INLINE CACHES
+
+/*
+Each symbol in a lambda gets a cache remembering the global value it
+resolved to, so looking up a global function again copies it without
+walking the environment.
+
+Lambdas see the variables of their callers, so a name some lambda
+binds as a local may resolve differently at every call. Those names
+are marked in lnames and never cached. A global being defined or set
+gives its context a new cache_version, which makes the caches of that
+context stale. Marking a new name can make caches of any context wrong,
+so it is counted in lcache_binds, and each context takes a new version
+when it sees the count change.
+*/
+static long lcache_binds = 0;
+
+/* Cache version of this thread's context, 0 without a context */
+long lcache_version_now(void) {
+	if (!lctx) { return 0; }
+	long binds = __atomic_load_n(&lcache_binds, __ATOMIC_RELAXED);
+	if (lctx->cache_binds != binds) {
+		lctx->cache_binds = binds;
+		lctx->cache_version = lctx_version();
+	}
+	return lctx->cache_version;
+}
+
+void lcache_invalidate(void) {
+	if (lctx) { lctx->cache_version = lctx_version(); }
+}
+
+/* Gives each symbol in v without a cache an empty one */
+void lcache_attach_expr(lval* v) {
+	if (v->type == LVAL_SYM && !v->cache) {
+		v->cache = malloc(sizeof(lcache));
+		v->cache->refs = 1;
+		v->cache->version = 0;
+		v->cache->env = NULL;
+		v->cache->value = NULL;
+		v->cache->bound = false;
+	}
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; i++) {
+			lcache_attach_expr(v->cell[i]);
+		}
+	}
+}
+
+void lcache_attach(lval* func) {
+	lcache_attach_expr(func->formals);
+	lcache_attach_expr(func->body);
+	if (func->folded) { lcache_attach_expr(func->folded); }
+}
+
+/* Called by lenv_put before k is bound in env */
+void lcache_bind(lenv* env, lval* k) {
+	if (lctx && env == lctx->env) {
+		lcache_invalidate();
+		return;
+	}
+	if (k->cache && k->cache->bound) { return; }
+	if (lname_bind(k->sym)) {
+		__atomic_fetch_add(&lcache_binds, 1, __ATOMIC_RELAXED);
+		lfold_shadow(k->sym);
+	}
+	if (k->cache) { k->cache->bound = true; }
+}
+
+/* lenv_get for a symbol with a cache */
+lval* lcache_get(lenv* env, lval* k) {
+	lcache* cache = k->cache;
+	if (cache->bound || !lctx) {
+		return lenv_get(env, k);
+	}
+	long version = lcache_version_now();
+	if (cache->version == version && cache->env == lctx->env) {
+		LSTAT(cache_hits);
+		return lval_copy(cache->value);
+	}
 
+	LSTAT(cache_misses);
+	lval* v = lenv_get(env, k);
+	if (v->type == LVAL_ERR) { return v; }
+	if (lname_bound(k->sym)) {
+		cache->bound = true;
+		return v;
+	}
+	// Never bound locally, so v was found in the global environment
+	lenv* global = lctx->env;
+	for (int i = 0; i < global->count; i++) {
+		if (global->syms[i] == k->sym) {
+			cache->version = version;
+			cache->env = global;
+			cache->value = global->vals[i];
+			break;
+		}
+	}
+	return v;
+}
 
 // Adds an lval element to a expression's cell
 lval* lval_add(lval* expression, lval* value) {
+	if (!expression->cells) {
+		expression->cells = lcells_new(4);
+	} else {
+		lval_own(expression);
+	}
+	lcells* cells = expression->cells;
+	// Double the space for new lvals when full
+	if (cells->count == cells->capacity) {
+		cells->capacity *= 2;
+		LSTAT(reallocs);
+		cells->items = realloc(cells->items, sizeof(lval*) * cells->capacity);
+	}
+	cells->items[cells->count++] = value;
+	expression->cell = cells->items;
 	expression->count++;
-	// Allocate extra space for new lval.
-	expression->cell = realloc(expression->cell, sizeof(lval*) * expression->count);
-	expression->cell[expression->count-1] = value;
 	return expression;
 }
 lval* lval_read_num(mpc_ast_t* tree) {
@@ -487,9 +1872,43 @@ lval* lval_read(mpc_ast_t* tree) {
 }
 
 lval* lval_eval_sexpr(lenv* env, lval* v) {
+	// Stop when a limit of the context is reached
+	if (lctx_stopped()) {
+		lval_del(v);
+		return lval_err("%s", lctx->abort);
+	}
+	// A macro call evaluates the expansion cached on its form
+	lcells* site = v->cells;
+	if (site && site->expansion) {
+		lval* code = lmacro_cached(v);
+		if (code) {
+			lval_del(v);
+			return lmacro_eval(env, code);
+		}
+	}
+	// Expansions are only cached on forms of shared code
+	if (site && (site->refs == 1
+		|| v->cell != site->items || v->count != site->count)) {
+		site = NULL;
+	}
+	// Children are replaced in place
+	lval_own(v);
 	// Evaluate children
 	for (int i = 0; i < v->count; i++) {
 		v->cell[i] = lval_eval(env, v->cell[i]);
+		if (i == 0 && v->cell[0]->type == LVAL_FUNC) {
+			// The arguements of a macro are not evaluated
+			if (v->cell[0]->macro) {
+				return lmacro_call(env, v, site != v->cells ? site : NULL);
+			}
+			// A special form evaluates its arguements as it needs them
+			if (v->cell[0]->special) {
+				lval* form = lval_pop(v, 0);
+				lval* result = form->builtin(env, v);
+				lval_del(form);
+				return result;
+			}
+		}
 	}
 	// Check for errors
 	for (int i = 0; i < v->count; i++) {
@@ -521,7 +1940,7 @@ lval* lval_eval_sexpr(lenv* env, lval* v) {
 lval* lval_eval(lenv* env, lval* v) {
 	if (v->type == LVAL_SYM) {
 		// Get a copy of v value
-		lval* result = lenv_get(env, v);
+		lval* result = v->cache ? lcache_get(env, v) : lenv_get(env, v);
 		// Delete original
 		lval_del(v);
 		return result;
@@ -536,17 +1955,34 @@ lval* lval_eval(lenv* env, lval* v) {
 
 // Pops a lval from a s-expression
 lval* lval_pop(lval* v, int i) {
-	lval* popped_lval = v->cell[i];
+	lval* popped_lval;
+
+	// Popping either end only narrows the view
+	if (i == 0 || i == v->count-1) {
+		// Shared cells are copied, unshared ones moved out
+		if (v->cells->refs == 1) {
+			v->cells->hash = 0;
+			popped_lval = v->cell[i];
+			v->cell[i] = NULL;
+		} else {
+			popped_lval = lval_copy(v->cell[i]);
+		}
+		if (i == 0) { v->cell++; }
+		v->count--;
+		lval_release_empty(v);
+		return popped_lval;
+	}
+
+	lval_own(v);
+	popped_lval = v->cell[i];
 	
 	// Decrease amount of items in s-expression
 	v->count--;
+	v->cells->count--;
 	
 	// Shift memory after the item at i over the top
 	memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i));
 	
-	// Reallocate memory
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	
 	return popped_lval;
 }
 // Takes a lval from a s-expression and deletes the s-expression
@@ -557,6 +1993,33 @@ lval* lval_take(lval* v, int i) {
 }
 // Moves all lvals from y to x
 lval* lval_join(lval* x, lval* y) {
+	// Joining onto nothing keeps y's shared cells
+	if (x->count == 0) {
+		y->type = x->type;
+		lval_del(x);
+		return y;
+	}
+	/*
+	Joining a short list onto a long one it doesn't share puts the
+	short one's cells in front, so building a list from the back, as
+	map and filter do, is linear.
+	*/
+	if (y->cells && y->cells->refs == 1 && x->count <= y->count) {
+		lval_reserve_front(y, x->count);
+		y->cells->hash = 0;
+		bool owned = x->cells->refs == 1;
+		for (int i = x->count - 1; i >= 0; i--) {
+			y->cell--;
+			if (*y->cell) { lval_del(*y->cell); }
+			// Unshared cells are moved, shared ones copied
+			*y->cell = owned ? x->cell[i] : lval_copy(x->cell[i]);
+			if (owned) { x->cell[i] = NULL; }
+			y->count++;
+		}
+		y->type = x->type;
+		lval_del(x);
+		return y;
+	}
 	// Each cell in y is added to x
 	while (y->count) {
 		x = lval_add(x, lval_pop(y, 0));
@@ -574,6 +2037,12 @@ char* ltype_name(int type) {
 		case LVAL_STR: return "String";
 		case LVAL_SEXPR: return "S-Expression";
 		case LVAL_QEXPR: return "Q-Expression";
+		case LVAL_VEC: return "Vector";
+		case LVAL_MAP: return "Map";
+		case LVAL_SBUF: return "String Builder";
+		case LVAL_SEQ: return "Lazy Sequence";
+		case LVAL_XFORM: return "Transducer";
+		case LVAL_FILE: return "File";
 		default: return "Unknown";
 	}
 }
@@ -623,6 +2092,7 @@ lval* builtin_op(lenv* env, lval* arg, char* operation) {
 		}
 		lval_del(y);
 	}
+	lval_del(arg);
 	return x;
 }
 lval* builtin_add(lenv* env, lval* arg) {
@@ -646,10 +2116,8 @@ lval* builtin_head(lenv* env, lval* arg) {
 	
 	// Else, take first arguement / head
 	lval* v = lval_take(arg, 0);
-	// Delete everything except for head and return
-	while (v->count > 1) {
-		lval_del(lval_pop(v,1));
-	}
+	// Narrow to the head and return
+	lval_truncate(v, 1);
 	return v;
 }
 lval* builtin_tail(lenv* env, lval* arg) {
@@ -660,10 +2128,40 @@ lval* builtin_tail(lenv* env, lval* arg) {
 	
 	// Else, take first arguement
 	lval* v = lval_take(arg, 0);
-	// Delete first element and return
-	lval_del(lval_pop(v, 0));
+	// Narrow past the first element and return
+	lval_drop(v, 1);
+	return v;
+}
+lval* builtin_take_drop(lenv* env, lval* arg, char* func_name) {
+	LASSERT_ARGS(arg, 2, func_name);
+	LASSERT_TYPE(arg, 0, LVAL_NUM, func_name);
+	LASSERT(arg, arg->cell[0]->num >= 0,
+		"'%s' passed a negative count. Got %li",
+		func_name, arg->cell[0]->num);
+	if (arg->cell[1]->type == LVAL_SEQ) {
+		return lseq_take_drop(env, arg, func_name);
+	}
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, func_name);
+
+	long n = arg->cell[0]->num;
+	lval* v = lval_take(arg, 1);
+	if (n > v->count) { n = v->count; }
+
+	if (strcmp(func_name, "take") == 0) {
+		lval_truncate(v, n);
+	} else {
+		lval_drop(v, n);
+	}
 	return v;
 }
+// Take n items from a list
+lval* builtin_take(lenv* env, lval* arg) {
+	return builtin_take_drop(env, arg, "take");
+}
+// Drop n items from a list
+lval* builtin_drop(lenv* env, lval* arg) {
+	return builtin_take_drop(env, arg, "drop");
+}
 // Converts a q-expression to a s-expression
 lval* builtin_list(lenv* env, lval* arg) {
 	arg->type = LVAL_QEXPR;
@@ -699,6 +2197,206 @@ lval* builtin_join(lenv* env, lval* arg) {
 	return x;
 }
 
+// Growable stack of values still to visit
+typedef struct lreach_stack {
+	lval** items;
+	int count;
+	int capacity;
+} lreach_stack;
+
+void lreach_push(lreach_stack* stack, lval* v) {
+	if (stack->count == stack->capacity) {
+		stack->capacity = stack->capacity ? stack->capacity * 2 : 16;
+		stack->items = realloc(stack->items, sizeof(lval*) * stack->capacity);
+	}
+	stack->items[stack->count++] = v;
+}
+
+/*
+Whether storage, the items of a vector or the entries of a map, is
+reachable from v. Putting such a v into that storage would make a value
+that contains itself, which could never be printed, compared or freed.
+Storage shared by several copies is only visited once.
+*/
+bool lval_reaches(lval* v, void* storage) {
+	lreach_stack stack = { NULL, 0, 0 };
+	lval* seen = NULL;
+	bool found = false;
+	lreach_push(&stack, v);
+	while (stack.count && !found) {
+		lval* x = stack.items[--stack.count];
+		void* shared;
+		switch (x->type) {
+			case LVAL_VEC: shared = x->vec; break;
+			case LVAL_MAP: shared = x->map; break;
+			case LVAL_SEXPR: case LVAL_QEXPR: shared = x->cells; break;
+			case LVAL_FUNC: shared = x->builtin ? NULL : x; break;
+			case LVAL_SEQ: shared = x->seq; break;
+			case LVAL_XFORM: shared = x->xform; break;
+			// Nothing else holds other values
+			default: shared = NULL; break;
+		}
+		if (!shared) { continue; }
+		if (shared == storage) {
+			found = true;
+			break;
+		}
+		if (!seen) { seen = lval_map(); }
+		lval* key = lval_num((long)shared);
+		if (lmap_get(seen->map, key)) {
+			lval_del(key);
+			continue;
+		}
+		lmap_put(seen->map, key, lval_num(1));
+
+		switch (x->type) {
+			case LVAL_VEC:
+				for (int i = 0; i < x->vec->count; i++) {
+					lreach_push(&stack, x->vec->items[i]);
+				}
+				break;
+			case LVAL_MAP:
+				for (int t = 0; t < 2; t++) {
+					lmap_table* table = &x->map->tables[t];
+					for (unsigned long i = 0; i < table->size; i++) {
+						for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+							lreach_push(&stack, e->key);
+							lreach_push(&stack, e->val);
+						}
+					}
+				}
+				break;
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				for (int i = 0; i < x->count; i++) {
+					lreach_push(&stack, x->cell[i]);
+				}
+				break;
+			case LVAL_FUNC:
+				lreach_push(&stack, x->body);
+				// Arguements bound by partial application
+				for (int i = 0; i < x->env->count; i++) {
+					lreach_push(&stack, x->env->vals[i]);
+				}
+				break;
+			case LVAL_SEQ:
+				for (lseq* q = x->seq; q; q = q->rest ? q->rest : q->src) {
+					if (q->func) { lreach_push(&stack, q->func); }
+					if (q->value) { lreach_push(&stack, q->value); }
+					if (q->first) { lreach_push(&stack, q->first); }
+				}
+				break;
+			case LVAL_XFORM:
+				for (int i = 0; i < x->xform->count; i++) {
+					if (x->xform->stages[i].func) {
+						lreach_push(&stack, x->xform->stages[i].func);
+					}
+				}
+				break;
+		}
+	}
+	free(stack.items);
+	if (seen) { lval_del(seen); }
+	return found;
+}
+
+// Creates a vector from its arguements
+lval* builtin_vec(lenv* env, lval* arg) {
+	lval* v = lval_vec();
+	// Move the arguements into the vector's storage
+	while (arg->count) {
+		lval_vec_push(v, lval_pop(arg, 0));
+	}
+	lval_del(arg);
+	return v;
+}
+
+/* Checks that index is a number within a vector's bounds */
+#define LASSERT_VEC_INDEX(arg, index, count, func_name) { \
+	LASSERT_TYPE(arg, index, LVAL_NUM, func_name); \
+	long i = arg->cell[index]->num; \
+	LASSERT(arg, i >= 0 && i < count, \
+		"'%s' index out of bounds. " \
+		"Got %li, Expected 0 to %i", \
+		func_name, i, count-1); \
+}
+
+lval* builtin_vec_ref(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "vec-ref");
+	LASSERT_TYPE(arg, 0, LVAL_VEC, "vec-ref");
+	LASSERT_VEC_INDEX(arg, 1, lval_vec_len(arg->cell[0]), "vec-ref");
+
+	// Return a copy of the element
+	lval* x = lval_copy(lval_vec_items(arg->cell[0])[arg->cell[1]->num]);
+	lval_del(arg);
+	return x;
+}
+
+lval* builtin_vec_set(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "vec-set!");
+	LASSERT_TYPE(arg, 0, LVAL_VEC, "vec-set!");
+	LASSERT_VEC_INDEX(arg, 1, lval_vec_len(arg->cell[0]), "vec-set!");
+	LASSERT(arg, !lval_reaches(arg->cell[2], arg->cell[0]->vec),
+		"'vec-set!' can not put a vector inside itself");
+
+	// Replace the element in the shared storage
+	lval** items = lval_vec_items(arg->cell[0]);
+	long i = arg->cell[1]->num;
+	lval_del(items[i]);
+	items[i] = lval_pop(arg, 2);
+
+	return lval_take(arg, 0);
+}
+
+lval* builtin_vec_len(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "vec-len");
+	LASSERT_TYPE(arg, 0, LVAL_VEC, "vec-len");
+
+	lval* x = lval_num(lval_vec_len(arg->cell[0]));
+	lval_del(arg);
+	return x;
+}
+
+lval* builtin_vec_push(lenv* env, lval* arg) {
+	LASSERT_TYPE(arg, 0, LVAL_VEC, "vec-push");
+	LASSERT(arg, !arg->cell[0]->slice,
+		"'vec-push' can not push onto a slice");
+	for (int i = 1; i < arg->count; i++) {
+		LASSERT(arg, !lval_reaches(arg->cell[i], arg->cell[0]->vec),
+			"'vec-push' can not put a vector inside itself");
+	}
+
+	lval* v = lval_pop(arg, 0);
+	// Push each remaining arguement in order
+	while (arg->count) {
+		lval_vec_push(v, lval_pop(arg, 0));
+	}
+	lval_del(arg);
+	return v;
+}
+
+// Slices [start, end) of a vector without copying its elements
+lval* builtin_vec_slice(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "vec-slice");
+	LASSERT_TYPE(arg, 0, LVAL_VEC, "vec-slice");
+	LASSERT_TYPE(arg, 1, LVAL_NUM, "vec-slice");
+	LASSERT_TYPE(arg, 2, LVAL_NUM, "vec-slice");
+
+	int count = lval_vec_len(arg->cell[0]);
+	long start = arg->cell[1]->num;
+	long end = arg->cell[2]->num;
+	LASSERT(arg, start >= 0 && start <= end && end <= count,
+		"'vec-slice' invalid bounds. "
+		"Got %li to %li, Expected within 0 to %i",
+		start, end, count);
+
+	lval* v = lval_take(arg, 0);
+	v->start += start;
+	v->len = end - start;
+	v->slice = true;
+	return v;
+}
+
 lval* builtin_lambda(lenv* env, lval* arg) {
 	char* func_name = "\\";
 	// Check for 2 arguements that are both q-expressions
@@ -716,7 +2414,12 @@ lval* builtin_lambda(lenv* env, lval* arg) {
 	lval_del(arg);
 
 	// Return user-defined funciton
-	return lval_lambda(formals, body);
+	lval* lambda = lval_lambda(formals, body);
+	lambda->folded = lfold_body(env, formals, body);
+	lambda->fold_epoch = lfold_epoch_now();
+	lcache_attach(lambda);
+	lambda->jit = ljit_new();
+	return lambda;
 }
 
 lval* builtin_def(lenv* env, lval* arg) {
@@ -743,9 +2446,15 @@ lval* builtin_var(lenv* env, lval* arg, char* func_name) {
 
 	// Put copies of values to symbols
 	for (int i = 0; i < syms->count; i++) {
+		lfold_guard(env, syms->cell[i], func_name);
 		// If def define variable globally
 		if (strcmp(func_name, "def") == 0) {
-			lenv_def(env, syms->cell[i], arg->cell[i+1]);
+			// Lambdas are named after the first variable they are defined as
+			lval* v = arg->cell[i+1];
+			if (v->type == LVAL_FUNC && !v->builtin && !v->name) {
+				v->name = lname_intern(syms->cell[i]->sym);
+			}
+			lenv_def(env, syms->cell[i], v);
 		}
 		// If put define variable locally
 		if (strcmp(func_name, "=") == 0) {
@@ -760,9 +2469,20 @@ lval* builtin_var(lenv* env, lval* arg, char* func_name) {
 lval* lval_call(lenv* env, lval* func, lval* arg) {
 	// Call builtin function if builtin
 	if (func->builtin) {
+		// Builtins calling builtins in a loop evaluate nothing, so check here too
+		if (lctx_stopped()) {
+			lval_del(arg);
+			return lval_err("%s", lctx->abort);
+		}
 		return func->builtin(env, arg);
 	}
 
+	// Hot numeric lambdas run as machine code instead
+	if (func->jit) {
+		lval* result = ljit_call(func, arg);
+		if (result) { return result; }
+	}
+
 	// Get arguement counts
 	int given = arg->count;
 	int total = func->formals->count;
@@ -778,7 +2498,7 @@ lval* lval_call(lenv* env, lval* func, lval* arg) {
 		// Pop first symbol from formals
 		lval* sym = lval_pop(func->formals, 0);
 		// If the symbol starts with &
-		if (strcmp(sym->sym, "&") == 0) {
+		if (sym->sym == lname_rest) {
 
 			// Check that the & is followed by another symbol
 			if (func->formals->count != 1) {
@@ -809,7 +2529,7 @@ lval* lval_call(lenv* env, lval* func, lval* arg) {
 
 	// If '&' remains in formal list, bind to empty list
 	if (func->formals->count > 0 && 
-		strcmp(func->formals->cell[0]->sym, "&") == 0) {
+		func->formals->cell[0]->sym == lname_rest) {
 		
 		// Check if that & is not passed invalidly.
 		if (func->formals->count != 2) {
@@ -834,9 +2554,18 @@ lval* lval_call(lenv* env, lval* func, lval* arg) {
 	if (func->formals->count == 0) {
 		// Set parent to evaluation environment
 		func->env->parent = env;
+		// The folded body is used until a builtin it relied on is rebound
+		lval* body = lfold_current(func) ? func->folded : func->body;
 		// Evaluate body and return
-		return builtin_eval(
-			func->env, lval_add(lval_sexpr(), lval_copy(func->body)));
+		if (!lprof_on) {
+			return builtin_eval(
+				func->env, lval_add(lval_sexpr(), lval_copy(body)));
+		}
+		lprof_push(func->name);
+		lval* result = builtin_eval(
+			func->env, lval_add(lval_sexpr(), lval_copy(body)));
+		lprof_pop();
+		return result;
 	} 
 	// Otherwise, return partially evaluated function
 	else {
@@ -885,8 +2614,13 @@ lval* builtin_ge(lenv* env, lval* arg) {
 lval* builtin_le(lenv* env, lval* arg) {
 	return builtin_ordering(env, arg, "<=");
 }
-/* Compares two lvals. */
-int lval_equal(lval* x, lval* y) {
+/*
+Compares two values without looking at their items. Returns 1 or 0, or
+-1 when the items of both have to be compared too. Lists and strings
+whose hashes were both computed already differ when their hashes do.
+*/
+int lval_equal_shallow(lval* x, lval* y) {
+	if (x == y) { return 1; }
 	// Unequal when types mismatch
 	if (x->type != y->type) {
 		return 0;
@@ -895,154 +2629,4589 @@ int lval_equal(lval* x, lval* y) {
 		case LVAL_NUM: return (x->num == y->num);
 
 		case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-		case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-		case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+		case LVAL_SYM: return x->sym == y->sym;
+		case LVAL_STR:
+			if (x->str_len != y->str_len) { return 0; }
+			if (x->hash && y->hash && x->hash != y->hash) { return 0; }
+			return memcmp(x->str, y->str, x->str_len) == 0;
+		case LVAL_SBUF:
+			return x->sbuf->len == y->sbuf->len
+				&& memcmp(x->sbuf->data, y->sbuf->data, x->sbuf->len) == 0;
 
 		case LVAL_FUNC:
 			// If one of the functions are builtin
 			if (x->builtin || y->builtin) {
 				return x->builtin == y->builtin;
-			} 
-			// Else, compare bodies and formals
-			else {
-				return lval_equal(x->formals, y->formals) 
-				&& lval_equal(x->body, y->body);
 			}
+			// Else, compare bodies and formals
+			return -1;
 		case LVAL_SEXPR: 
 		case LVAL_QEXPR:
 			// Not equal if the counts are not the same
 			if (x->count != y->count) { return 0; }
-			// Compare both expressions
-			for (int i = 0; i < x->count; i++) {
-				// Whole list unequal when there is unequal element
-				if (!lval_equal(x->cell[i], y->cell[i])) {
-					return 0;
-				}
-			}
-			// Else, lists are equal;
-			return 1;
-		break;	
+			// Equal when both view the same cells
+			if (x->cell == y->cell) { return 1; }
+			unsigned long hx = lval_cells_hash(x);
+			unsigned long hy = lval_cells_hash(y);
+			if (hx && hy && hx != hy) { return 0; }
+			return -1;
+		case LVAL_VEC:
+			if (lval_vec_len(x) != lval_vec_len(y)) { return 0; }
+			if (lval_vec_items(x) == lval_vec_items(y)) { return 1; }
+			return -1;
+		case LVAL_MAP: return lmap_equal(x->map, y->map);
+		// Sequences may be endless, so only the same one is equal
+		case LVAL_SEQ: return x->seq == y->seq;
+		case LVAL_XFORM: return x->xform == y->xform;
+		case LVAL_FILE: return x->file == y->file;
 	}
 	return 0;
 }
 
-// Builtin comparison function
-lval* builtin_compare(lenv* env, lval* arg, char* operation) {
-	// Check that there are two arguements
-	LASSERT_ARGS(arg, 2, operation);
+// Pairs of values lval_equal still has to compare the items of
+typedef struct lequal_stack {
+	lval** items;
+	int count;
+	int capacity;
+	lval* local[64];
+} lequal_stack;
 
-	int result;
-	if (strcmp(operation, "==") == 0) {
-		result = lval_equal(arg->cell[0], arg->cell[1]);
-	} 
-	if (strcmp(operation, "!=") == 0) {
-		result = !lval_equal(arg->cell[0], arg->cell[1]);
+void lequal_push(lequal_stack* stack, lval* x, lval* y) {
+	if (stack->count + 2 > stack->capacity) {
+		stack->capacity *= 2;
+		if (stack->items == stack->local) {
+			stack->items = malloc(sizeof(lval*) * stack->capacity);
+			memcpy(stack->items, stack->local, sizeof(stack->local));
+		} else {
+			stack->items = realloc(stack->items, sizeof(lval*) * stack->capacity);
+		}
 	}
-	lval_del(arg);
-	return lval_num(result);
+	stack->items[stack->count++] = x;
+	stack->items[stack->count++] = y;
 }
-lval* builtin_equal(lenv* env, lval* arg) {
-	return builtin_compare(env, arg, "==");
-}
-lval* builtin_not_equal(lenv* env, lval* arg) {
+
+/*
+Compares the items of x and y, which are the same length. Items that
+need no further look are compared now, the rest are pushed. Returns 0
+when an item already differs.
+*/
+int lequal_push_items(lequal_stack* stack, lval* x, lval* y) {
+	lval** xs;
+	lval** ys;
+	int count;
+	switch (x->type) {
+		case LVAL_FUNC:
+			lequal_push(stack, x->formals, y->formals);
+			lequal_push(stack, x->body, y->body);
+			return 1;
+		case LVAL_VEC:
+			xs = lval_vec_items(x);
+			ys = lval_vec_items(y);
+			count = lval_vec_len(x);
+			break;
+		default:
+			xs = x->cell;
+			ys = y->cell;
+			count = x->count;
+	}
+	for (int i = 0; i < count; i++) {
+		int equal = lval_equal_shallow(xs[i], ys[i]);
+		if (equal == 0) { return 0; }
+		if (equal < 0) { lequal_push(stack, xs[i], ys[i]); }
+	}
+	return 1;
+}
+
+/* Compares two lvals, without recursing so deep lists are fine. */
+int lval_equal(lval* x, lval* y) {
+	int equal = lval_equal_shallow(x, y);
+	if (equal >= 0) { return equal; }
+
+	lequal_stack stack;
+	stack.items = stack.local;
+	stack.count = 0;
+	stack.capacity = sizeof(stack.local) / sizeof(lval*);
+	equal = lequal_push_items(&stack, x, y);
+	while (equal && stack.count > 0) {
+		lval* b = stack.items[--stack.count];
+		lval* a = stack.items[--stack.count];
+		equal = lequal_push_items(&stack, a, b);
+	}
+	if (stack.items != stack.local) { free(stack.items); }
+	return equal;
+}
+lval* builtin_compare(lenv* env, lval* arg, char* operation) {
+	// Check that there are two arguements
+	LASSERT_ARGS(arg, 2, operation);
+
+	int result;
+	if (strcmp(operation, "==") == 0) {
+		result = lval_equal(arg->cell[0], arg->cell[1]);
+	} 
+	if (strcmp(operation, "!=") == 0) {
+		result = !lval_equal(arg->cell[0], arg->cell[1]);
+	}
+	lval_del(arg);
+	return lval_num(result);
+}
+lval* builtin_equal(lenv* env, lval* arg) {
+	return builtin_compare(env, arg, "==");
+}
+lval* builtin_not_equal(lenv* env, lval* arg) {
 	return builtin_compare(env, arg, "!=");
 }
-lval* builtin_if(lenv* env, lval* arg) {
-	LASSERT_ARGS(arg, 3, "if");
-	LASSERT_TYPE(arg, 0, LVAL_NUM, "if");
-	LASSERT_TYPE(arg, 1, LVAL_QEXPR, "if");
-	LASSERT_TYPE(arg, 2, LVAL_QEXPR, "if");
+// HASH MAPS
+
+/* Finalizer mixing the bits of a 64 bit hash */
+unsigned long lhash_mix(unsigned long h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+/* FNV-1a hash of len bytes */
+unsigned long lhash_bytes(char* s, int len) {
+	unsigned long h = 0xcbf29ce484222325UL;
+	for (int i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3UL;
+	}
+	return h;
+}
+/* FNV-1a hash of a string */
+unsigned long lhash_str(char* s) {
+	return lhash_bytes(s, strlen(s));
+}
+/*
+Hashes an lval, clearing *stable when it holds a vector, map or string
+builder, whose contents may change. A string keeps its hash until it
+is changed. A list with only stable values in it keeps its hash on the
+cells it shares with its copies, so a list stored in a variable is
+hashed once however often copies of it are looked up or compared.
+Values that are equal by lval_equal always hash the same.
+*/
+/* Mixes the hash h of v, caching it when inner says v is stable */
+unsigned long lhash_finish(lval* v, unsigned long h, bool inner) {
+	h = lhash_mix(h);
+	// 0 marks a hash not computed yet
+	if (h == 0) { h = 1; }
+	if (inner && v->type == LVAL_STR) { v->hash = h; }
+	if (inner && (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->cells) {
+		v->cells->hash = h;
+		v->cells->hash_cell = v->cell;
+		v->cells->hash_count = v->count;
+	}
+	return h;
+}
+
+/*
+Hashes v when it holds no values to hash first, returning false when it
+does. Clears *inner when v may change.
+*/
+bool lhash_leaf(lval* v, unsigned long* hash, bool* inner) {
+	if (v->type == LVAL_STR && v->hash) { *hash = v->hash; return true; }
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		*hash = lval_cells_hash(v);
+		return *hash != 0;
+	}
+	unsigned long h = v->type;
+	switch (v->type) {
+		case LVAL_NUM: h ^= (unsigned long)v->num; break;
+		case LVAL_ERR: h ^= lhash_str(v->err); break;
+		// Symbols are interned with a hash of their name
+		case LVAL_SYM: h ^= lname_entry(v->sym)->hash; break;
+		case LVAL_STR: h ^= lhash_bytes(v->str, v->str_len); break;
+		case LVAL_SBUF:
+			h ^= lhash_bytes(v->sbuf->data, v->sbuf->len);
+			*inner = false;
+			break;
+		case LVAL_FUNC:
+			// Builtins compare by pointer, lambdas by formals and body
+			if (!v->builtin) { return false; }
+			h ^= (unsigned long)v->builtin;
+			break;
+		case LVAL_VEC: case LVAL_MAP: return false;
+		case LVAL_SEQ: h ^= (unsigned long)v->seq; break;
+		case LVAL_XFORM: h ^= (unsigned long)v->xform; break;
+		case LVAL_FILE: h ^= (unsigned long)v->file; break;
+	}
+	*hash = lhash_finish(v, h, *inner);
+	return true;
+}
+
+/* A value part way through hashing, and where its next inner value is */
+typedef struct {
+	lval* v;
+	unsigned long h;
+	unsigned long acc;
+	bool inner;
+	int i;
+	int table;
+	unsigned long bucket;
+	lmap_entry* entry;
+} lhash_frame;
+
+/* The next value inside frame to hash, or NULL when there are no more */
+lval* lhash_next(lhash_frame* frame) {
+	lval* v = frame->v;
+	switch (v->type) {
+		case LVAL_FUNC:
+			if (frame->i == 2) { return NULL; }
+			return frame->i++ ? v->body : v->formals;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			return frame->i < v->count ? v->cell[frame->i++] : NULL;
+		case LVAL_VEC:
+			return frame->i < lval_vec_len(v) ? lval_vec_items(v)[frame->i++] : NULL;
+		case LVAL_MAP:
+			if (frame->entry && frame->entry->next) {
+				frame->entry = frame->entry->next;
+				return frame->entry->val;
+			}
+			while (frame->table < 2) {
+				lmap_table* table = &v->map->tables[frame->table];
+				while (frame->bucket < table->size) {
+					frame->entry = table->buckets[frame->bucket++];
+					if (frame->entry) { return frame->entry->val; }
+				}
+				frame->table++;
+				frame->bucket = 0;
+			}
+			return NULL;
+	}
+	return NULL;
+}
+
+/* Combines the hash of the last value lhash_next gave into frame */
+void lhash_combine(lhash_frame* frame, unsigned long h) {
+	switch (frame->v->type) {
+		case LVAL_FUNC: frame->acc = frame->acc * 31 + h; break;
+		// Entry order depends on the table, so combine them unordered
+		case LVAL_MAP: frame->h += frame->entry->hash ^ h; break;
+		default: frame->h = frame->h * 31 + h; break;
+	}
+}
+
+/*
+Hashes an lval, clearing *stable when it holds a vector, map or string
+builder, whose contents may change. A string keeps its hash until it
+is changed. A list with only stable values in it keeps its hash on the
+cells it shares with its copies, so a list stored in a variable is
+hashed once however often copies of it are looked up or compared.
+Values that are equal by lval_equal always hash the same. Values
+inside v are hashed with a stack of frames rather than by recursion,
+so deeply nested values can't overflow the C stack.
+*/
+unsigned long lhash_value(lval* v, bool* stable) {
+	unsigned long h;
+	bool inner = true;
+	if (lhash_leaf(v, &h, &inner)) {
+		if (!inner) { *stable = false; }
+		return h;
+	}
+
+	lhash_frame* frames = NULL;
+	int count = 0;
+	int capacity = 0;
+	lval* next = v;
+	while (true) {
+		if (next) {
+			// Values inside next need hashing first
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				frames = realloc(frames, sizeof(lhash_frame) * capacity);
+			}
+			// Builtins turn one kind of list into the other in place, so both hash alike
+			bool list = next->type == LVAL_SEXPR || next->type == LVAL_QEXPR;
+			frames[count++] = (lhash_frame){
+				next, list ? LVAL_QEXPR : next->type, 0, true, 0, 0, 0, NULL
+			};
+		}
+		lhash_frame* top = &frames[count - 1];
+		next = lhash_next(top);
+		if (next) {
+			bool child_inner = true;
+			if (lhash_leaf(next, &h, &child_inner)) {
+				if (!child_inner) { top->inner = false; }
+				lhash_combine(top, h);
+				next = NULL;
+			}
+			continue;
+		}
+
+		// Every value inside top is hashed, so finish it
+		if (top->v->type == LVAL_FUNC) { top->h ^= top->acc; }
+		if (top->v->type == LVAL_VEC || top->v->type == LVAL_MAP) { top->inner = false; }
+		h = lhash_finish(top->v, top->h, top->inner);
+		inner = top->inner;
+		if (--count == 0) { break; }
+		if (!inner) { frames[count - 1].inner = false; }
+		lhash_combine(&frames[count - 1], h);
+	}
+	free(frames);
+	if (!inner) { *stable = false; }
+	return h;
+}
+unsigned long lval_hash(lval* v) {
+	bool stable = true;
+	return lhash_value(v, &stable);
+}
+
+unsigned long lmap_count(lmap* map) {
+	return map->tables[0].used + map->tables[1].used;
+}
+
+/* Moves up to n buckets from the old table to the new one */
+void lmap_rehash_step(lmap* map, int n) {
+	if (map->rehash < 0) { return; }
+	lmap_table* from = &map->tables[0];
+	lmap_table* to = &map->tables[1];
+
+	while (n-- > 0 && (unsigned long)map->rehash < from->size) {
+		lmap_entry* entry = from->buckets[map->rehash];
+		while (entry) {
+			lmap_entry* next = entry->next;
+			unsigned long i = entry->hash & (to->size - 1);
+			entry->next = to->buckets[i];
+			to->buckets[i] = entry;
+			from->used--;
+			to->used++;
+			entry = next;
+		}
+		from->buckets[map->rehash++] = NULL;
+	}
+	// When every bucket has moved, the new table becomes the main one
+	if ((unsigned long)map->rehash == from->size) {
+		lctx_bytes(-(long)sizeof(lmap_entry*) * from->size);
+		free(from->buckets);
+		map->tables[0] = map->tables[1];
+		map->tables[1] = (lmap_table){ NULL, 0, 0 };
+		map->rehash = -1;
+	}
+}
+
+/*
+Finds the link pointing at the entry for key, or NULL.
+Sets found to the table holding the entry when it is not NULL.
+*/
+lmap_entry** lmap_find(lmap* map, lval* key, unsigned long hash, lmap_table** found) {
+	for (int t = 0; t < 2; t++) {
+		lmap_table* table = &map->tables[t];
+		if (table->size == 0) { continue; }
+		lmap_entry** link = &table->buckets[hash & (table->size - 1)];
+		while (*link) {
+			if ((*link)->hash == hash && lval_equal((*link)->key, key)) {
+				if (found) { *found = table; }
+				return link;
+			}
+			link = &(*link)->next;
+		}
+	}
+	return NULL;
+}
+
+/* Looks up the value stored for key, or NULL */
+lval* lmap_get(lmap* map, lval* key) {
+	lmap_rehash_step(map, 1);
+	lmap_entry** link = lmap_find(map, key, lval_hash(key), NULL);
+	return link ? (*link)->val : NULL;
+}
+
+/* Stores val for key, taking ownership of both */
+void lmap_put(lmap* map, lval* key, lval* val) {
+	lmap_rehash_step(map, 1);
+	unsigned long hash = lval_hash(key);
+
+	// Replace the value of an existing key
+	lmap_entry** link = lmap_find(map, key, hash, NULL);
+	if (link) {
+		lval_del((*link)->val);
+		(*link)->val = val;
+		lval_del(key);
+		return;
+	}
+
+	// Start growing once the load factor reaches 1
+	lmap_table* table = &map->tables[0];
+	if (map->rehash < 0 && table->used >= table->size) {
+		unsigned long size = table->size ? table->size * 2 : 8;
+		lctx_bytes(sizeof(lmap_entry*) * size);
+		if (table->size == 0) {
+			table->buckets = calloc(size, sizeof(lmap_entry*));
+			table->size = size;
+		} else {
+			map->tables[1].buckets = calloc(size, sizeof(lmap_entry*));
+			map->tables[1].size = size;
+			map->rehash = 0;
+		}
+	}
+	// New entries go into the new table while rehashing
+	if (map->rehash >= 0) {
+		table = &map->tables[1];
+	}
+
+	lmap_entry* entry = malloc(sizeof(lmap_entry));
+	lctx_bytes(sizeof(lmap_entry));
+	unsigned long i = hash & (table->size - 1);
+	entry->hash = hash;
+	entry->key = key;
+	entry->val = val;
+	entry->next = table->buckets[i];
+	table->buckets[i] = entry;
+	table->used++;
+}
+
+/* Removes key from the map, returns whether it was found */
+bool lmap_del(lmap* map, lval* key) {
+	lmap_rehash_step(map, 1);
+	unsigned long hash = lval_hash(key);
+	lmap_table* table;
+	lmap_entry** link = lmap_find(map, key, hash, &table);
+	if (!link) { return false; }
+
+	lmap_entry* entry = *link;
+	*link = entry->next;
+	table->used--;
+	lval_del(entry->key);
+	lval_del(entry->val);
+	lctx_bytes(-(long)sizeof(lmap_entry));
+	free(entry);
+	return true;
+}
+
+/* Maps are equal when they hold equal values for the same keys */
+int lmap_equal(lmap* x, lmap* y) {
+	if (x == y) { return 1; }
+	if (lmap_count(x) != lmap_count(y)) { return 0; }
+	for (int t = 0; t < 2; t++) {
+		lmap_table* table = &x->tables[t];
+		for (unsigned long i = 0; i < table->size; i++) {
+			for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+				lmap_entry** link = lmap_find(y, e->key, e->hash, NULL);
+				if (!link || !lval_equal(e->val, (*link)->val)) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+/* Collects the keys (0), values (1) or {key value} pairs (2) of a map */
+lval* lmap_list(lmap* map, int what) {
+	lval* list = lval_qexpr();
+	for (int t = 0; t < 2; t++) {
+		lmap_table* table = &map->tables[t];
+		for (unsigned long i = 0; i < table->size; i++) {
+			for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+				switch (what) {
+					case 0: lval_add(list, lval_copy(e->key)); break;
+					case 1: lval_add(list, lval_copy(e->val)); break;
+					case 2:
+						lval_add(list, lval_add(lval_add(lval_qexpr(),
+							lval_copy(e->key)), lval_copy(e->val)));
+						break;
+				}
+			}
+		}
+	}
+	return list;
+}
+
+/*
+A value inside key that can change in place, a vector, map, string
+builder, sequence, transducer or file, or NULL when there is none. A
+key that changes after it is stored could never be found again.
+*/
+lval* lmap_mutable_key(lval* key) {
+	lreach_stack stack = { NULL, 0, 0 };
+	lval* found = NULL;
+	lreach_push(&stack, key);
+	while (stack.count && !found) {
+		lval* x = stack.items[--stack.count];
+		switch (x->type) {
+			case LVAL_VEC: case LVAL_MAP: case LVAL_SBUF:
+			case LVAL_SEQ: case LVAL_XFORM: case LVAL_FILE:
+				found = x;
+				break;
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				for (int i = 0; i < x->count; i++) {
+					lreach_push(&stack, x->cell[i]);
+				}
+				break;
+			case LVAL_FUNC:
+				// Lambdas hash and compare by their formals and body
+				if (!x->builtin) { lreach_push(&stack, x->body); }
+				break;
+		}
+	}
+	free(stack.items);
+	return found;
+}
+
+/* Checks the keys and values of pairs from index start of arg for map */
+#define LASSERT_MAP_PAIRS(arg, start, map, func_name) { \
+	for (int i = (start); i < arg->count; i += 2) { \
+		lval* bad = lmap_mutable_key(arg->cell[i]); \
+		LASSERT(arg, !bad, "'%s' can not use a key holding a %s. " \
+			"Expected a key that can't change", \
+			func_name, ltype_name(bad->type)); \
+		LASSERT(arg, !(map) || !lval_reaches(arg->cell[i + 1], (map)), \
+			"'%s' can not put a map inside itself", func_name); \
+	} \
+}
+
+/* Assertion macro for a map arguement */
+#define LASSERT_MAP(arg, func_name) { \
+	LASSERT(arg, arg->count > 0, "'%s' passed no arguements", func_name); \
+	LASSERT_TYPE(arg, 0, LVAL_MAP, func_name); \
+}
+
+// Creates a map from alternating keys and values
+lval* builtin_hmap(lenv* env, lval* arg) {
+	LASSERT(arg, arg->count % 2 == 0,
+		"'hmap' passed a key without a value. "
+		"Got %i arguements, Expected an even number", arg->count);
+	LASSERT_MAP_PAIRS(arg, 0, NULL, "hmap");
+
+	lval* v = lval_map();
+	while (arg->count) {
+		lval* key = lval_pop(arg, 0);
+		lmap_put(v->map, key, lval_pop(arg, 0));
+	}
+	lval_del(arg);
+	return v;
+}
+
+// Gets the value of a key, or the default when given one
+lval* builtin_hget(lenv* env, lval* arg) {
+	LASSERT(arg, arg->count == 2 || arg->count == 3,
+		"'hget' has the wrong number of arguments. "
+		"Got %i, Expected 2 or 3", arg->count);
+	LASSERT_TYPE(arg, 0, LVAL_MAP, "hget");
+
+	lval* val = lmap_get(arg->cell[0]->map, arg->cell[1]);
+	if (val) {
+		val = lval_copy(val);
+	} else if (arg->count == 3) {
+		val = lval_pop(arg, 2);
+	} else {
+		val = lval_err("'hget' key not found");
+	}
+	lval_del(arg);
+	return val;
+}
+
+// Puts alternating keys and values into a map
+lval* builtin_hput(lenv* env, lval* arg) {
+	LASSERT_MAP(arg, "hput");
+	LASSERT(arg, arg->count % 2 == 1,
+		"'hput' passed a key without a value. "
+		"Got %i arguements, Expected an odd number", arg->count);
+	LASSERT_MAP_PAIRS(arg, 1, arg->cell[0]->map, "hput");
+
+	lval* v = lval_pop(arg, 0);
+	while (arg->count) {
+		lval* key = lval_pop(arg, 0);
+		lmap_put(v->map, key, lval_pop(arg, 0));
+	}
+	lval_del(arg);
+	return v;
+}
+
+// Deletes keys from a map
+lval* builtin_hdel(lenv* env, lval* arg) {
+	LASSERT_MAP(arg, "hdel");
+
+	lval* v = lval_pop(arg, 0);
+	for (int i = 0; i < arg->count; i++) {
+		lmap_del(v->map, arg->cell[i]);
+	}
+	lval_del(arg);
+	return v;
+}
+
+lval* builtin_hhas(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "hhas");
+	LASSERT_TYPE(arg, 0, LVAL_MAP, "hhas");
+
+	lval* x = lval_num(lmap_get(arg->cell[0]->map, arg->cell[1]) != NULL);
+	lval_del(arg);
+	return x;
+}
+
+lval* builtin_hlen(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "hlen");
+	LASSERT_TYPE(arg, 0, LVAL_MAP, "hlen");
+
+	lval* x = lval_num(lmap_count(arg->cell[0]->map));
+	lval_del(arg);
+	return x;
+}
+
+lval* builtin_hlist(lenv* env, lval* arg, char* func_name, int what) {
+	LASSERT_ARGS(arg, 1, func_name);
+	LASSERT_TYPE(arg, 0, LVAL_MAP, func_name);
+
+	lval* list = lmap_list(arg->cell[0]->map, what);
+	lval_del(arg);
+	return list;
+}
+lval* builtin_hkeys(lenv* env, lval* arg) {
+	return builtin_hlist(env, arg, "hkeys", 0);
+}
+lval* builtin_hvals(lenv* env, lval* arg) {
+	return builtin_hlist(env, arg, "hvals", 1);
+}
+lval* builtin_hitems(lenv* env, lval* arg) {
+	return builtin_hlist(env, arg, "hitems", 2);
+}
+
+lval* builtin_if(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "if");
+	LASSERT_TYPE(arg, 0, LVAL_NUM, "if");
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, "if");
+	LASSERT_TYPE(arg, 2, LVAL_QEXPR, "if");
+
+	lval* result;
+	// Set to s-expressions for evaluation
+	arg->cell[1]->type = LVAL_SEXPR;
+	arg->cell[2]->type = LVAL_SEXPR;
+
+	// If condition is true
+	if (arg->cell[0]->num) {
+		// Evaluate first expression
+		result = lval_eval(env, lval_pop(arg, 1));
+	} else {
+		// Or evaluate second expression
+		result = lval_eval(env, lval_pop(arg, 2));
+	}
+	lval_del(arg);
+	return result;
+}
+
+// Loads a lispa file
+lval* builtin_load(lenv* env, lval* arg) {
+	// Ensure that there is one arguement that is a string
+	LASSERT_ARGS(arg, 1, "load");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "load");
+
+	LASSERT(arg, lctx, "'load' is not available without a context");
+
+	mpc_result_t result;
+	// Parse file by string name
+	if (mpc_parse_contents(arg->cell[0]->str, lctx->Lispy, &result)) {
+		// Read contents
+		lval* expression = lval_read(result.output);
+		//char* result.error->filename;
+		mpc_ast_delete(result.output);
+		
+		// Evaluate each expression
+		while (expression->count > 0) {
+			lval* result = lval_eval(env, lval_pop(expression, 0));
+			// If there is an error, print it
+			if (result->type == LVAL_ERR) {
+				lval_println(lctx_out(), result);
+				
+			}
+			lval_del(result);
+		}
+		
+		// Delete arguements and expressions
+		lval_del(expression);
+		lval_del(arg);
+
+		// Return empty list
+		return lval_sexpr();
+	} 
+	// If unable to parse file
+	else {
+		// Get parser error
+		char* error_message = mpc_err_string(result.error);
+		mpc_err_delete(result.error);
+
+		// Create error lval message from parser error
+		lval* error = lval_err("Could not load library %s", error_message);
+
+		// Delete error message and arguements
+		free(error_message);
+		lval_del(arg);
+
+		return error;
+	}
+}
+
+lval* builtin_print(lenv* env, lval* arg) {
+	// Print each arguement with a space
+	lout* out = lctx_out();
+	for (int i = 0; i < arg->count; i++) {
+		lval_print(out, arg->cell[i]);
+		lout_putc(out, ' ');
+	}
+	// Newline, flush and delete arguements
+	lout_putc(out, '\n');
+	lout_end(out);
+	lval_del(arg);
+
+	return lval_sexpr();
+}
+
+lval* builtin_error(lenv* env, lval* arg) {
+	// Check that there is only one string arguement
+	LASSERT_ARGS(arg, 1, "error");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "error");
+
+	// Create error from first arguement
+	lval* error = lval_err(arg->cell[0]->str);
+	lval_del(arg);
+
+	return error;
+}
+// STRINGS
+
+/*
+Finds the first needle in len bytes of string, or NULL.
+memchr jumps between candidate first bytes, which libc vectorizes.
+*/
+char* lstr_find(char* string, int len, char* needle, int needle_len) {
+	if (needle_len == 0) { return string; }
+	char* end = string + len - needle_len + 1;
+	while (string < end) {
+		string = memchr(string, needle[0], end - string);
+		if (!string) { return NULL; }
+		if (memcmp(string, needle, needle_len) == 0) { return string; }
+		string++;
+	}
+	return NULL;
+}
+
+/* Assertion macro for all arguements being strings */
+#define LASSERT_STRINGS(arg, start, func_name) { \
+	for (int i = start; i < arg->count; i++) { \
+		LASSERT_TYPE(arg, i, LVAL_STR, func_name); \
+	} \
+}
+
+// Concatenates strings with a single allocation
+lval* builtin_str_cat(lenv* env, lval* arg) {
+	LASSERT_STRINGS(arg, 0, "str-cat");
+
+	int len = 0;
+	for (int i = 0; i < arg->count; i++) {
+		len += arg->cell[i]->str_len;
+	}
+	char* str = malloc(len + 1);
+	char* end = str;
+	for (int i = 0; i < arg->count; i++) {
+		memcpy(end, arg->cell[i]->str, arg->cell[i]->str_len);
+		end += arg->cell[i]->str_len;
+	}
+	*end = '\0';
+
+	lval_del(arg);
+	return lval_str_take(str, len);
+}
+
+// Length of a string or string builder
+lval* builtin_str_len(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "str-len");
+	lval* s = arg->cell[0];
+	LASSERT(arg, s->type == LVAL_STR || s->type == LVAL_SBUF,
+		"'str-len' passed the incorrect type. "
+		"Got %s, Expected %s", ltype_name(s->type), ltype_name(LVAL_STR));
+
+	lval* x = lval_num(s->type == LVAL_STR ? s->str_len : s->sbuf->len);
+	lval_del(arg);
+	return x;
+}
+
+// Characters [start, end) of a string
+lval* builtin_substr(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "substr");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "substr");
+	LASSERT_TYPE(arg, 1, LVAL_NUM, "substr");
+	LASSERT_TYPE(arg, 2, LVAL_NUM, "substr");
+
+	int len = arg->cell[0]->str_len;
+	long start = arg->cell[1]->num;
+	long end = arg->cell[2]->num;
+	LASSERT(arg, start >= 0 && start <= end && end <= len,
+		"'substr' invalid bounds. "
+		"Got %li to %li, Expected within 0 to %i",
+		start, end, len);
+
+	lval* x = lval_str_len(arg->cell[0]->str + start, end - start);
+	lval_del(arg);
+	return x;
+}
+
+// Index of the first occurence of a string, or -1
+lval* builtin_str_find(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "str-find");
+	LASSERT_STRINGS(arg, 0, "str-find");
+
+	lval* s = arg->cell[0];
+	lval* needle = arg->cell[1];
+	char* found = lstr_find(s->str, s->str_len, needle->str, needle->str_len);
+
+	lval* x = lval_num(found ? found - s->str : -1);
+	lval_del(arg);
+	return x;
+}
+
+// Splits a string into a list of strings at each seperator
+lval* builtin_str_split(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "str-split");
+	LASSERT_STRINGS(arg, 0, "str-split");
+	LASSERT(arg, arg->cell[1]->str_len > 0,
+		"'str-split' passed an empty seperator");
+
+	lval* s = arg->cell[0];
+	lval* sep = arg->cell[1];
+	lval* list = lval_qexpr();
+
+	char* start = s->str;
+	char* end = s->str + s->str_len;
+	char* found;
+	while ((found = lstr_find(start, end - start, sep->str, sep->str_len))) {
+		lval_add(list, lval_str_len(start, found - start));
+		start = found + sep->str_len;
+	}
+	lval_add(list, lval_str_len(start, end - start));
+
+	lval_del(arg);
+	return list;
+}
+
+// Joins a list of strings with a seperator between each
+lval* builtin_str_join(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "str-join");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "str-join");
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, "str-join");
+
+	lval* sep = arg->cell[0];
+	lval* list = arg->cell[1];
+	LASSERT_STRINGS(list, 0, "str-join");
+
+	lval* x = lval_sbuf("", 0);
+	for (int i = 0; i < list->count; i++) {
+		if (i > 0) { lval_sbuf_add(x, sep->str, sep->str_len); }
+		lval_sbuf_add(x, list->cell[i]->str, list->cell[i]->str_len);
+	}
+	// Hand the builder's buffer over to the string
+	lval* result = lval_str_take(x->sbuf->data, x->sbuf->len);
+	x->sbuf->data = NULL;
+	lval_del(x);
+	lval_del(arg);
+	return result;
+}
+
+lval* builtin_num_to_str(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "num->str");
+	LASSERT_TYPE(arg, 0, LVAL_NUM, "num->str");
+
+	char buffer[21];
+	int len = lfmt_num(buffer, arg->cell[0]->num);
+	lval_del(arg);
+	return lval_str_len(buffer, len);
+}
+
+lval* builtin_str_to_num(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "str->num");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "str->num");
+
+	char* end;
+	errno = 0;
+	long x = strtol(arg->cell[0]->str, &end, 10);
+	// The whole string must be a number in range
+	LASSERT(arg, errno != ERANGE && end != arg->cell[0]->str && *end == '\0',
+		"'str->num' passed an invalid number. Got \"%s\"",
+		arg->cell[0]->str);
+
+	lval_del(arg);
+	return lval_num(x);
+}
+
+// Creates a string builder from the concatenation of strings
+lval* builtin_sbuf(lenv* env, lval* arg) {
+	LASSERT_STRINGS(arg, 0, "sbuf");
+
+	lval* x = lval_sbuf("", 0);
+	for (int i = 0; i < arg->count; i++) {
+		lval_sbuf_add(x, arg->cell[i]->str, arg->cell[i]->str_len);
+	}
+	lval_del(arg);
+	return x;
+}
+
+// Appends strings to a string builder in place
+lval* builtin_sbuf_add(lenv* env, lval* arg) {
+	LASSERT(arg, arg->count > 0, "'sbuf-add' passed no arguements");
+	LASSERT_TYPE(arg, 0, LVAL_SBUF, "sbuf-add");
+	LASSERT_STRINGS(arg, 1, "sbuf-add");
+
+	lval* x = lval_pop(arg, 0);
+	for (int i = 0; i < arg->count; i++) {
+		lval_sbuf_add(x, arg->cell[i]->str, arg->cell[i]->str_len);
+	}
+	lval_del(arg);
+	return x;
+}
+
+// Copies the contents of a string builder into a string
+lval* builtin_sbuf_str(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "sbuf-str");
+	LASSERT_TYPE(arg, 0, LVAL_SBUF, "sbuf-str");
+
+	lsbuf* sbuf = arg->cell[0]->sbuf;
+	lval* x = lval_str_len(sbuf->data, sbuf->len);
+	lval_del(arg);
+	return x;
+}
+
+// PARALLEL
+
+/*
+pmap, pfilter and preduce split a list into chunks that run on a pool
+of worker threads. Storage shared between copies is reference counted
+without locks, so each worker evaluates in its own clone of the
+function and clones the elements it reads. Nothing is shared between
+threads until every worker is done. The pool runs one job at a time, a
+job started while another context's job has it runs on the calling
+thread instead.
+
+Rather than the whole environment, workers clone only the variables
+the function and elements can reach: every symbol in them, looked up
+where the job starts, and what those values reach in turn. Names only
+found in code read while the job runs, by load or deserialize, are
+unbound in the workers. Each worker has a context of its own held to
+the caller's time limit and what is left of its memory limit, and
+writing to the caller's output.
+*/
+
+/*
+Deep copies v without sharing any storage with it, so the clone can
+be used on another thread while v is still in use on this one.
+*/
+lval* lval_clone(lval* v) {
+	lval* clone;
+	switch (v->type) {
+		case LVAL_NUM: return lval_num(v->num);
+		case LVAL_ERR: return lval_err("%s", v->err);
+		case LVAL_SYM: return lval_sym_interned(v->sym);
+		case LVAL_STR: return lval_str_len(v->str, v->str_len);
+		case LVAL_SBUF: return lval_sbuf(v->sbuf->data, v->sbuf->len);
+		case LVAL_FUNC:
+			if (v->builtin) {
+				clone = lval_func(v->builtin);
+				clone->macro = v->macro;
+				clone->special = v->special;
+				return clone;
+			}
+			clone = lval_lambda(lval_clone(v->formals), lval_clone(v->body));
+			clone->name = v->name;
+			clone->macro = v->macro;
+			if (v->folded) {
+				clone->folded = lval_clone(v->folded);
+				clone->fold_epoch = v->fold_epoch;
+			}
+			// The parent is set again when the lambda is called
+			lenv_del(clone->env);
+			clone->env = lenv_clone(v->env);
+			lenv_del_chain(clone->env->parent);
+			clone->env->parent = NULL;
+			// Caches are per thread, the clone gets empty ones
+			lcache_attach(clone);
+			if (v->jit) { clone->jit = ljit_new(); }
+			return clone;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			clone = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+			for (int i = 0; i < v->count; i++) {
+				lval_add(clone, lval_clone(v->cell[i]));
+			}
+			return clone;
+		case LVAL_VEC: {
+			int count = lval_vec_len(v);
+			lval** items = lval_vec_items(v);
+			clone = lval_vec();
+			for (int i = 0; i < count; i++) {
+				lval_vec_push(clone, lval_clone(items[i]));
+			}
+			return clone;
+		}
+		case LVAL_MAP:
+			clone = lval_map();
+			for (int t = 0; t < 2; t++) {
+				lmap_table* table = &v->map->tables[t];
+				for (unsigned long i = 0; i < table->size; i++) {
+					for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+						lmap_put(clone->map, lval_clone(e->key), lval_clone(e->val));
+					}
+				}
+			}
+			return clone;
+		case LVAL_SEQ: return lval_seq(lseq_clone(v->seq));
+		case LVAL_XFORM: return lval_xform(lxform_clone(v->xform));
+		case LVAL_FILE: {
+			// A file can't be read from two threads, the clone is closed
+			lfile* f = calloc(1, sizeof(lfile));
+			f->refs = 1;
+			return lval_file(f);
+		}
+	}
+	return lval_err("Can not clone %s", ltype_name(v->type));
+}
+// Deep copies an environment and its parents, see lval_clone
+lenv* lenv_clone(lenv* env) {
+	lenv* clone = lenv_new();
+	clone->count = env->count;
+	clone->syms = malloc(sizeof(char*) * env->count);
+	clone->vals = malloc(sizeof(lval*) * env->count);
+	for (int i = 0; i < env->count; i++) {
+		clone->syms[i] = env->syms[i];
+		clone->vals[i] = lval_clone(env->vals[i]);
+	}
+	if (env->parent) {
+		clone->parent = lenv_clone(env->parent);
+	}
+	return clone;
+}
+
+enum ljob_kinds { LJOB_MAP, LJOB_FILTER, LJOB_REDUCE };
+
+typedef struct ljob {
+	int kind;
+	lenv* env;
+	lval* func;
+	lval* list;
+	// Context of the caller, and the variables the workers can reach
+	lispa_ctx* ctx;
+	lenv* reach;
+	int tasks;
+	// Number of elements in each task's chunk
+	int chunk;
+	// One result per element, or per task when reducing
+	lval** results;
+} ljob;
+
+/*
+Adds to reach the value each symbol in v has in env, then what those
+values reach. seen holds the symbols already looked up.
+*/
+void ljob_reach(lenv* env, lenv* reach, lmap* seen, lval* v) {
+	switch (v->type) {
+		case LVAL_SYM: {
+			if (lmap_get(seen, v)) { return; }
+			lmap_put(seen, lval_sym_interned(v->sym), lval_num(1));
+			lval* val = lenv_get(env, v);
+			if (val->type == LVAL_ERR) {
+				lval_del(val);
+				return;
+			}
+			reach->count++;
+			reach->syms = realloc(reach->syms, sizeof(char*) * reach->count);
+			reach->vals = realloc(reach->vals, sizeof(lval*) * reach->count);
+			reach->syms[reach->count - 1] = v->sym;
+			reach->vals[reach->count - 1] = val;
+			ljob_reach(env, reach, seen, val);
+			return;
+		}
+		case LVAL_FUNC:
+			if (v->builtin) { return; }
+			ljob_reach(env, reach, seen, v->body);
+			if (v->folded) { ljob_reach(env, reach, seen, v->folded); }
+			// Arguements bound by partial application
+			for (int i = 0; i < v->env->count; i++) {
+				ljob_reach(env, reach, seen, v->env->vals[i]);
+			}
+			return;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++) {
+				ljob_reach(env, reach, seen, v->cell[i]);
+			}
+			return;
+		case LVAL_VEC: {
+			int count = lval_vec_len(v);
+			lval** items = lval_vec_items(v);
+			for (int i = 0; i < count; i++) {
+				ljob_reach(env, reach, seen, items[i]);
+			}
+			return;
+		}
+		case LVAL_MAP:
+			for (int t = 0; t < 2; t++) {
+				lmap_table* table = &v->map->tables[t];
+				for (unsigned long i = 0; i < table->size; i++) {
+					for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+						ljob_reach(env, reach, seen, e->key);
+						ljob_reach(env, reach, seen, e->val);
+					}
+				}
+			}
+			return;
+		case LVAL_SEQ:
+			for (lseq* s = v->seq; s; s = s->rest ? s->rest : s->src) {
+				if (s->func) { ljob_reach(env, reach, seen, s->func); }
+				if (s->value) { ljob_reach(env, reach, seen, s->value); }
+				if (s->first) { ljob_reach(env, reach, seen, s->first); }
+			}
+			return;
+		case LVAL_XFORM:
+			for (int i = 0; i < v->xform->count; i++) {
+				lval* func = v->xform->stages[i].func;
+				if (func) { ljob_reach(env, reach, seen, func); }
+			}
+			return;
+	}
+}
+
+/* Calls func with one or two arguements */
+lval* ljob_call(lenv* env, lval* func, lval* a, lval* b) {
+	lval* arg = lval_add(lval_sexpr(), a);
+	if (b) { lval_add(arg, b); }
+	lval* f = lval_copy(func);
+	lval* result = lval_call(env, f, arg);
+	lval_del(f);
+	return result;
+}
+
+/* Runs one chunk of a job, reading elements through clone */
+void ljob_run(ljob* job, lenv* env, lval* func, int task, lval* (*clone)(lval*)) {
+	int start = task * job->chunk;
+	int end = start + job->chunk;
+	if (end > job->list->count) { end = job->list->count; }
+	lval** cell = job->list->cell;
+
+	if (job->kind == LJOB_REDUCE) {
+		lval* acc = clone(cell[start]);
+		for (int i = start + 1; i < end && acc->type != LVAL_ERR; i++) {
+			acc = ljob_call(env, func, acc, clone(cell[i]));
+		}
+		job->results[task] = acc;
+		return;
+	}
+	for (int i = start; i < end; i++) {
+		job->results[i] = ljob_call(env, func, clone(cell[i]), NULL);
+	}
+}
+
+#ifndef LISPA_NO_THREADS
+
+// Whether this thread is one of the pool's workers
+static __thread bool lpool_in_worker = false;
+
+typedef struct lworker {
+	pthread_t thread;
+	// Deque of task numbers, owner pops the bottom and thieves the top
+	pthread_mutex_t lock;
+	int* tasks;
+	int top;
+	int bottom;
+	// Clones used by this worker for the current job
+	lenv* env;
+	lval* func;
+	// Context the worker evaluates in
+	lispa_ctx* ctx;
+} lworker;
+
+struct {
+	int size;
+	lworker* workers;
+	// Held by the context whose job is using the pool
+	pthread_mutex_t run;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	ljob* job;
+	unsigned long generation;
+	// Tasks not yet finished and workers not yet idle
+	int pending;
+	int active;
+} lpool;
+
+/* Pops a task from the worker's own deque, or steals one from another */
+int lpool_next_task(lworker* self) {
+	int task = -1;
+	pthread_mutex_lock(&self->lock);
+	if (self->top < self->bottom) {
+		task = self->tasks[--self->bottom];
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	int index = self - lpool.workers;
+	for (int i = 1; task < 0 && i < lpool.size; i++) {
+		lworker* victim = &lpool.workers[(index + i) % lpool.size];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->top < victim->bottom) {
+			task = victim->tasks[victim->top++];
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return task;
+}
+
+void* lpool_worker(void* arg) {
+	lworker* self = arg;
+	unsigned long seen = 0;
+	lpool_in_worker = true;
+
+	pthread_mutex_lock(&lpool.lock);
+	while (1) {
+		// Sleep until a new job is posted
+		while (lpool.generation == seen) {
+			pthread_cond_wait(&lpool.work, &lpool.lock);
+		}
+		seen = lpool.generation;
+		ljob* job = lpool.job;
+		pthread_mutex_unlock(&lpool.lock);
+		lctx_use(job->ctx ? self->ctx : NULL);
+
+		int task;
+		while ((task = lpool_next_task(self)) >= 0) {
+			// Clone on first use, the caller is blocked so this is read only
+			if (!self->env) {
+				self->env = lenv_clone(job->reach);
+				self->func = lval_clone(job->func);
+				self->ctx->env = self->env;
+			}
+			ljob_run(job, self->env, self->func, task, lval_clone);
+
+			pthread_mutex_lock(&lpool.lock);
+			if (--lpool.pending == 0) {
+				pthread_cond_signal(&lpool.done);
+			}
+			pthread_mutex_unlock(&lpool.lock);
+		}
+		if (self->env) {
+			lenv_del(self->env);
+			lval_del(self->func);
+			self->env = NULL;
+			self->func = NULL;
+			self->ctx->env = NULL;
+		}
+		if (job->ctx) { lout_flush(&self->ctx->out); }
+
+		pthread_mutex_lock(&lpool.lock);
+		if (--lpool.active == 0) {
+			pthread_cond_signal(&lpool.done);
+		}
+	}
+	return NULL;
+}
+
+/*
+Starts one worker per core the first time the pool is used.
+LISPA_THREADS in the environment overrides the number of workers.
+*/
+void lpool_init(void) {
+	if (lpool.size) { return; }
+	char* threads = getenv("LISPA_THREADS");
+	long cores = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+	lpool.size = cores > 0 ? cores : 1;
+	lpool.workers = calloc(lpool.size, sizeof(lworker));
+	pthread_mutex_init(&lpool.run, NULL);
+	pthread_mutex_init(&lpool.lock, NULL);
+	pthread_cond_init(&lpool.work, NULL);
+	pthread_cond_init(&lpool.done, NULL);
+	for (int i = 0; i < lpool.size; i++) {
+		pthread_mutex_init(&lpool.workers[i].lock, NULL);
+		lpool.workers[i].ctx = calloc(1, sizeof(lispa_ctx));
+		pthread_create(&lpool.workers[i].thread, NULL,
+			lpool_worker, &lpool.workers[i]);
+	}
+}
+
+/*
+Takes the pool for one job, false when a job of another context is
+using it. lpool_release gives it back.
+*/
+bool lpool_acquire(void) {
+	lpool_init();
+	return pthread_mutex_trylock(&lpool.run) == 0;
+}
+
+void lpool_release(void) {
+	pthread_mutex_unlock(&lpool.run);
+}
+
+/* Starts a worker's context on a job of the caller's context */
+void lpool_enter(lispa_ctx* ctx, lispa_ctx* caller) {
+	lctx_share_parsers(ctx, caller);
+	ctx->out.file = caller->out.file;
+	ctx->limited = caller->limited;
+	ctx->timeout_ms = caller->timeout_ms;
+	ctx->deadline = caller->deadline;
+	ctx->abort = caller->abort;
+	ctx->steps = 0;
+	ctx->values_start = ctx->values;
+	ctx->bytes_start = ctx->bytes;
+	// Cloned lambdas keep their folded bodies
+	ctx->fold_epoch = lfold_epoch_now();
+	ctx->fold_shadows = caller->fold_shadows;
+	ctx->cache_version = lctx_version();
+	// Each worker may use what the caller has left
+	ctx->max_memory = 0;
+	if (caller->max_memory) {
+		long left = caller->max_memory - lctx_used(caller);
+		ctx->max_memory = left > 0 ? left : 1;
+	}
+}
+
+/*
+Ends a worker's context on a job. The values it made and handed over
+are counted on the caller from now on, and a limit it hit stops the
+caller too.
+*/
+void lpool_leave(lispa_ctx* ctx, lispa_ctx* caller) {
+	long made = ctx->values - ctx->values_start;
+	ctx->values -= made;
+	caller->values += made;
+	long bytes = ctx->bytes - ctx->bytes_start;
+	ctx->bytes -= bytes;
+	caller->bytes += bytes;
+	if (ctx->abort && !caller->abort) { caller->abort = ctx->abort; }
+}
+
+/* Runs every task of a job on the acquired pool and waits for them */
+void lpool_run(ljob* job) {
+	// Variables the workers need, looked up on this thread
+	job->ctx = lctx;
+	job->reach = lenv_new();
+	lval* seen = lval_map();
+	ljob_reach(job->env, job->reach, seen->map, job->func);
+	ljob_reach(job->env, job->reach, seen->map, job->list);
+	lval_del(seen);
+	if (job->ctx) {
+		for (int i = 0; i < lpool.size; i++) {
+			lpool_enter(lpool.workers[i].ctx, job->ctx);
+		}
+	}
+
+	pthread_mutex_lock(&lpool.lock);
+
+	// Deal the tasks out to the workers' deques
+	for (int i = 0; i < lpool.size; i++) {
+		lworker* w = &lpool.workers[i];
+		w->tasks = realloc(w->tasks, sizeof(int) * (job->tasks / lpool.size + 1));
+		w->top = 0;
+		w->bottom = 0;
+	}
+	for (int task = 0; task < job->tasks; task++) {
+		lworker* w = &lpool.workers[task % lpool.size];
+		w->tasks[w->bottom++] = task;
+	}
+
+	lpool.job = job;
+	lpool.pending = job->tasks;
+	lpool.active = lpool.size;
+	lpool.generation++;
+	pthread_cond_broadcast(&lpool.work);
+	while (lpool.pending > 0 || lpool.active > 0) {
+		pthread_cond_wait(&lpool.done, &lpool.lock);
+	}
+	pthread_mutex_unlock(&lpool.lock);
+
+	// Every worker is idle and has deleted its clones
+	if (job->ctx) {
+		for (int i = 0; i < lpool.size; i++) {
+			lpool_leave(lpool.workers[i].ctx, job->ctx);
+		}
+	}
+	lenv_del(job->reach);
+}
+
+#endif
+
+/* Runs a job on the pool, or on this thread when that is not possible */
+lval* ljob_start(lenv* env, lval* arg, int kind, char* func_name) {
+	LASSERT_ARGS(arg, 2, func_name);
+	LASSERT_TYPE(arg, 0, LVAL_FUNC, func_name);
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, func_name);
+
+	ljob job;
+	job.kind = kind;
+	job.env = env;
+	job.func = arg->cell[0];
+	job.list = arg->cell[1];
+	int count = job.list->count;
+	if (count == 0) {
+		lval_del(arg);
+		return lval_qexpr();
+	}
+
+	// Several tasks per core so idle workers have something to steal
+	int workers = 1;
+#ifndef LISPA_NO_THREADS
+	// Jobs of other contexts wait for nothing, they run on their own thread
+	bool pooled = !lpool_in_worker && lpool_acquire();
+	if (pooled) { workers = lpool.size; }
+#endif
+	job.tasks = workers * 4 < count ? workers * 4 : count;
+	job.chunk = (count + job.tasks - 1) / job.tasks;
+	job.tasks = (count + job.chunk - 1) / job.chunk;
+	job.results = calloc(kind == LJOB_REDUCE ? job.tasks : count, sizeof(lval*));
+
+#ifndef LISPA_NO_THREADS
+	if (workers > 1) {
+		lpool_run(&job);
+	} else
+#endif
+	{
+		// Nested jobs run in place, as the workers are already busy
+		for (int task = 0; task < job.tasks; task++) {
+			ljob_run(&job, env, job.func, task, lval_copy);
+		}
+	}
+#ifndef LISPA_NO_THREADS
+	if (pooled) { lpool_release(); }
+#endif
+
+	// Gather results in order, stopping at the first error
+	lval* result = kind == LJOB_REDUCE ? NULL : lval_qexpr();
+	int results = kind == LJOB_REDUCE ? job.tasks : count;
+	for (int i = 0; i < results; i++) {
+		lval* x = job.results[i];
+		job.results[i] = NULL;
+		if (x->type == LVAL_ERR) {
+			if (result) { lval_del(result); }
+			result = x;
+			break;
+		}
+		switch (kind) {
+			case LJOB_MAP: lval_add(result, x); break;
+			case LJOB_FILTER:
+				if (x->type == LVAL_NUM && x->num) {
+					lval_add(result, lval_copy(job.list->cell[i]));
+				}
+				lval_del(x);
+				break;
+			case LJOB_REDUCE:
+				// Fold the chunk results together in order
+				result = result ? ljob_call(env, job.func, result, x) : x;
+				if (result->type == LVAL_ERR) { i = results; }
+				break;
+		}
+	}
+	for (int i = 0; i < results; i++) {
+		if (job.results[i]) { lval_del(job.results[i]); }
+	}
+	free(job.results);
+	lval_del(arg);
+	return result;
+}
+
+// Applies a function to each element of a list in parallel
+lval* builtin_pmap(lenv* env, lval* arg) {
+	return ljob_start(env, arg, LJOB_MAP, "pmap");
+}
+// Keeps the elements of a list a function is true for, in parallel
+lval* builtin_pfilter(lenv* env, lval* arg) {
+	return ljob_start(env, arg, LJOB_FILTER, "pfilter");
+}
+// Reduces a list with an associative function, in parallel
+lval* builtin_preduce(lenv* env, lval* arg) {
+	return ljob_start(env, arg, LJOB_REDUCE, "preduce");
+}
+
+// LAZY SEQUENCES
+
+/*
+A lazy sequence is a chain of nodes, each computed only when something
+pulls it. Forcing an unrealized node computes its first item and makes
+the rest a new unrealized node. Nodes are freed once nothing references
+them, so a pipeline over a long or endless sequence runs in constant
+memory as long as no name holds on to its start.
+*/
+
+enum lseq_kinds {
+	// Realized
+	LSEQ_DONE,
+	// Numbers from, from+step... up to but not including to
+	LSEQ_RANGE,
+	// value, then func applied to it again and again. from is 1 once
+	// value is the item before rather than the item itself
+	LSEQ_ITERATE,
+	// Items from index from of value, a list or vector
+	LSEQ_LIST,
+	// func applied to the items of src
+	LSEQ_MAP,
+	// Items of src func is true for
+	LSEQ_FILTER,
+	// Items of src after the first from
+	LSEQ_DROP,
+	// Lines of value, a file
+	LSEQ_LINES
+};
+
+/* Unrealized node, taking ownership of func, src and value */
+lseq* lseq_new(int kind, lval* func, lseq* src, lval* value) {
+	lseq* s = calloc(1, sizeof(lseq));
+	s->refs = 1;
+	s->kind = kind;
+	s->func = func;
+	s->src = src;
+	s->value = value;
+	return s;
+}
+
+lseq* lseq_ref(lseq* s) {
+	s->refs++;
+	return s;
+}
+
+// Drops a reference to s, freeing the nodes after it nothing else holds
+void lseq_release(lseq* s) {
+	while (s && --s->refs == 0) {
+		lseq* next = s->rest ? s->rest : s->src;
+		if (s->first) { lval_del(s->first); }
+		if (s->func) { lval_del(s->func); }
+		if (s->value) { lval_del(s->value); }
+		free(s);
+		s = next;
+	}
+}
+
+// Moves on to the rest of a realized node, dropping the reference to it
+lseq* lseq_next(lseq* s) {
+	lseq* rest = lseq_ref(s->rest);
+	lseq_release(s);
+	return rest;
+}
+
+/* Realizes s with first and rest, NULL at the end, taking ownership of both */
+void lseq_set(lseq* s, lval* first, lseq* rest) {
+	if (s->func) { lval_del(s->func); }
+	if (s->value) { lval_del(s->value); }
+	lseq* src = s->src;
+	s->kind = LSEQ_DONE;
+	s->first = first;
+	s->rest = rest;
+	s->func = NULL;
+	s->src = NULL;
+	s->value = NULL;
+	lseq_release(src);
+}
+
+/*
+Realizes s if it is not yet. Returns NULL, or an error a function gave,
+leaving s to be forced again.
+*/
+lval* lseq_force(lenv* env, lseq* s) {
+	// Pulling a long sequence may evaluate nothing, so check the limits
+	if (lctx_stopped()) { return lval_err("%s", lctx->abort); }
+	switch (s->kind) {
+		case LSEQ_RANGE: {
+			if (s->step > 0 ? s->from >= s->to : s->from <= s->to) {
+				lseq_set(s, NULL, NULL);
+				return NULL;
+			}
+			lseq* rest = lseq_new(LSEQ_RANGE, NULL, NULL, NULL);
+			rest->to = s->to;
+			rest->step = s->step;
+			// Past the largest number there is nothing left
+			if (__builtin_add_overflow(s->from, s->step, &rest->from)) {
+				rest->kind = LSEQ_DONE;
+			}
+			lseq_set(s, lval_num(s->from), rest);
+			return NULL;
+		}
+		case LSEQ_ITERATE: {
+			lval* x = s->value;
+			if (s->from) {
+				x = ljob_call(env, s->func, lval_copy(s->value), NULL);
+				if (x->type == LVAL_ERR) { return x; }
+			} else {
+				s->value = NULL;
+			}
+			// The function moves on to the rest
+			lseq* rest = lseq_new(LSEQ_ITERATE, s->func, NULL, lval_copy(x));
+			rest->from = 1;
+			s->func = NULL;
+			lseq_set(s, x, rest);
+			return NULL;
+		}
+		case LSEQ_LIST: {
+			lval* list = s->value;
+			int count = list->type == LVAL_VEC ? lval_vec_len(list) : list->count;
+			if (s->from >= count) {
+				lseq_set(s, NULL, NULL);
+				return NULL;
+			}
+			lval** items = list->type == LVAL_VEC ? lval_vec_items(list) : list->cell;
+			lseq* rest = lseq_new(LSEQ_LIST, NULL, NULL, list);
+			rest->from = s->from + 1;
+			s->value = NULL;
+			lseq_set(s, lval_copy(items[s->from]), rest);
+			return NULL;
+		}
+		case LSEQ_MAP: {
+			lval* err = lseq_force(env, s->src);
+			if (err) { return err; }
+			lseq* src = s->src;
+			if (!src->first) {
+				lseq_set(s, NULL, NULL);
+				return NULL;
+			}
+			lval* x = ljob_call(env, s->func, lval_copy(src->first), NULL);
+			if (x->type == LVAL_ERR) { return x; }
+			lseq* rest = lseq_new(LSEQ_MAP, s->func, lseq_ref(src->rest), NULL);
+			s->func = NULL;
+			lseq_set(s, x, rest);
+			return NULL;
+		}
+		case LSEQ_FILTER:
+			while (true) {
+				lval* err = lseq_force(env, s->src);
+				if (err) { return err; }
+				lseq* src = s->src;
+				if (!src->first) {
+					lseq_set(s, NULL, NULL);
+					return NULL;
+				}
+				lval* keep = ljob_call(env, s->func, lval_copy(src->first), NULL);
+				if (keep->type == LVAL_ERR) { return keep; }
+				if (keep->type != LVAL_NUM) {
+					err = lval_err("'lazy-filter' function returned %s. Expected %s",
+						ltype_name(keep->type), ltype_name(LVAL_NUM));
+					lval_del(keep);
+					return err;
+				}
+				bool kept = keep->num != 0;
+				lval_del(keep);
+				if (kept) {
+					lseq* rest = lseq_new(LSEQ_FILTER, s->func, lseq_ref(src->rest), NULL);
+					s->func = NULL;
+					lseq_set(s, lval_copy(src->first), rest);
+					return NULL;
+				}
+				// Skipped items are let go of straight away
+				s->src = lseq_next(src);
+			}
+		case LSEQ_DROP: {
+			lval* err = lseq_force(env, s->src);
+			if (err) { return err; }
+			while (s->from > 0 && s->src->first) {
+				s->src = lseq_next(s->src);
+				s->from--;
+				err = lseq_force(env, s->src);
+				if (err) { return err; }
+			}
+			lseq* src = s->src;
+			lseq_set(s, src->first ? lval_copy(src->first) : NULL,
+				src->first ? lseq_ref(src->rest) : NULL);
+			return NULL;
+		}
+		case LSEQ_LINES: {
+			lfile* f = s->value->file;
+			if (!f->file) { return lval_err("'lines' passed a closed file"); }
+			lval* line = lfile_read_line(f);
+			if (line && line->type == LVAL_ERR) { return line; }
+			if (!line) {
+				lseq_set(s, NULL, NULL);
+				return NULL;
+			}
+			lseq* rest = lseq_new(LSEQ_LINES, NULL, NULL, s->value);
+			s->value = NULL;
+			lseq_set(s, line, rest);
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Whether v can be read as a sequence
+bool lseq_is_source(lval* v) {
+	return v->type == LVAL_SEQ || v->type == LVAL_QEXPR || v->type == LVAL_VEC;
+}
+
+/* Sequence of the items of v, a sequence, list or vector, deleting v */
+lseq* lseq_of(lval* v) {
+	if (v->type == LVAL_SEQ) {
+		lseq* s = lseq_ref(v->seq);
+		lval_del(v);
+		return s;
+	}
+	return lseq_new(LSEQ_LIST, NULL, NULL, v);
+}
+
+/* Deep copies a sequence, see lval_clone */
+lseq* lseq_clone(lseq* s) {
+	lseq* clone = NULL;
+	lseq** link = &clone;
+	// Each node leads on to one other at most
+	while (s) {
+		lseq* c = lseq_new(s->kind,
+			s->func ? lval_clone(s->func) : NULL, NULL,
+			s->value ? lval_clone(s->value) : NULL);
+		c->first = s->first ? lval_clone(s->first) : NULL;
+		c->from = s->from;
+		c->to = s->to;
+		c->step = s->step;
+		*link = c;
+		link = s->rest ? &c->rest : &c->src;
+		s = s->rest ? s->rest : s->src;
+	}
+	return clone;
+}
+
+/*
+take gives a list of the first n items, pulling no more than those.
+drop gives a sequence that skips n items when it is first pulled.
+*/
+lval* lseq_take_drop(lenv* env, lval* arg, char* func_name) {
+	long n = arg->cell[0]->num;
+	lseq* s = lseq_ref(arg->cell[1]->seq);
+	lval_del(arg);
+
+	if (strcmp(func_name, "drop") == 0) {
+		lseq* drop = lseq_new(LSEQ_DROP, NULL, s, NULL);
+		drop->from = n;
+		return lval_seq(drop);
+	}
+	lval* list = lval_qexpr();
+	for (long i = 0; i < n; i++) {
+		lval* err = lseq_force(env, s);
+		if (err) {
+			lval_del(list);
+			list = err;
+			break;
+		}
+		if (!s->first) { break; }
+		lval_add(list, lval_copy(s->first));
+		s = lseq_next(s);
+	}
+	lseq_release(s);
+	return list;
+}
+
+// Lazy sequence of numbers, (range end), (range start end) or (range start end step)
+lval* builtin_range(lenv* env, lval* arg) {
+	LASSERT(arg, arg->count >= 1 && arg->count <= 3,
+		"'range' passed %i arguements. Expected 1 to 3", arg->count);
+	for (int i = 0; i < arg->count; i++) {
+		LASSERT_TYPE(arg, i, LVAL_NUM, "range");
+	}
+	long step = arg->count == 3 ? arg->cell[2]->num : 1;
+	LASSERT(arg, step != 0, "'range' passed a step of 0");
+
+	lseq* s = lseq_new(LSEQ_RANGE, NULL, NULL, NULL);
+	s->from = arg->count > 1 ? arg->cell[0]->num : 0;
+	s->to = arg->count > 1 ? arg->cell[1]->num : arg->cell[0]->num;
+	s->step = step;
+	lval_del(arg);
+	return lval_seq(s);
+}
+
+// Endless lazy sequence x, (f x), (f (f x))..., (iterate f x)
+lval* builtin_iterate(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "iterate");
+	LASSERT_TYPE(arg, 0, LVAL_FUNC, "iterate");
+	lval* func = lval_pop(arg, 0);
+	return lval_seq(lseq_new(LSEQ_ITERATE, func, NULL, lval_take(arg, 0)));
+}
+
+lval* builtin_lazy(lenv* env, lval* arg, char* func_name, int kind) {
+	LASSERT_ARGS(arg, 2, func_name);
+	LASSERT_TYPE(arg, 0, LVAL_FUNC, func_name);
+	LASSERT(arg, lseq_is_source(arg->cell[1]),
+		"'%s' passed the incorrect type. Got %s, Expected %s",
+		func_name, ltype_name(arg->cell[1]->type), ltype_name(LVAL_SEQ));
+	lval* func = lval_pop(arg, 0);
+	return lval_seq(lseq_new(kind, func, lseq_of(lval_take(arg, 0)), NULL));
+}
+
+// Lazy sequence of a function applied to each item, (lazy-map f seq)
+lval* builtin_lazy_map(lenv* env, lval* arg) {
+	return builtin_lazy(env, arg, "lazy-map", LSEQ_MAP);
+}
+
+// Lazy sequence of the items a function is true for, (lazy-filter f seq)
+lval* builtin_lazy_filter(lenv* env, lval* arg) {
+	return builtin_lazy(env, arg, "lazy-filter", LSEQ_FILTER);
+}
+
+// Folds the items of a sequence from the left as they are pulled, (seq-fold f acc seq)
+lval* builtin_seq_fold(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "seq-fold");
+	LASSERT_TYPE(arg, 0, LVAL_FUNC, "seq-fold");
+	LASSERT(arg, lseq_is_source(arg->cell[2]),
+		"'seq-fold' passed the incorrect type. Got %s, Expected %s",
+		ltype_name(arg->cell[2]->type), ltype_name(LVAL_SEQ));
+	lval* func = lval_pop(arg, 0);
+	lval* acc = lval_pop(arg, 0);
+	// Nothing else holds the start of the sequence, so pulled nodes are freed
+	lseq* s = lseq_of(lval_take(arg, 0));
+
+	while (acc->type != LVAL_ERR) {
+		lval* err = lseq_force(env, s);
+		if (err) {
+			lval_del(acc);
+			acc = err;
+			break;
+		}
+		if (!s->first) { break; }
+		acc = ljob_call(env, func, acc, lval_copy(s->first));
+		s = lseq_next(s);
+	}
+	lseq_release(s);
+	lval_del(func);
+	return acc;
+}
+
+// TRANSDUCERS
+
+/*
+A transducer is a list of stages each item passes through in turn,
+built with xmap, xfilter and xtake and chained with comp. transduce
+and into run a whole pipeline over a list, vector or sequence in one
+pass, handing each item that comes out straight to the reducer, so no
+list is built between stages.
+*/
+
+enum lxform_kinds { LXFORM_MAP, LXFORM_FILTER, LXFORM_TAKE };
+
+/* Transducer of count stages, its functions to be filled in */
+lxform* lxform_new(int count) {
+	lxform* xf = malloc(sizeof(lxform));
+	xf->refs = 1;
+	xf->count = count;
+	xf->stages = calloc(count ? count : 1, sizeof(lxstage));
+	return xf;
+}
+
+void lxform_release(lxform* xf) {
+	if (--xf->refs > 0) { return; }
+	for (int i = 0; i < xf->count; i++) {
+		if (xf->stages[i].func) { lval_del(xf->stages[i].func); }
+	}
+	free(xf->stages);
+	free(xf);
+}
+
+/* Deep copies a transducer, see lval_clone */
+lxform* lxform_clone(lxform* xf) {
+	lxform* clone = lxform_new(xf->count);
+	for (int i = 0; i < xf->count; i++) {
+		clone->stages[i] = xf->stages[i];
+		if (xf->stages[i].func) {
+			clone->stages[i].func = lval_clone(xf->stages[i].func);
+		}
+	}
+	return clone;
+}
+
+/*
+Runs the items of source, a list, vector or sequence, through xf into
+acc. Each item that comes out is reduced with func, or appended to acc
+when func is NULL. Takes ownership of acc and source, and returns the
+result or the first error.
+*/
+lval* lxform_run(lenv* env, lxform* xf, lval* func, lval* acc, lval* source) {
+	// Items each take stage still lets through in this run
+	long* left = malloc(sizeof(long) * (xf->count ? xf->count : 1));
+	bool stop = false;
+	for (int i = 0; i < xf->count; i++) {
+		left[i] = xf->stages[i].n;
+		if (xf->stages[i].kind == LXFORM_TAKE && left[i] == 0) { stop = true; }
+	}
+
+	lval** items = source->type == LVAL_VEC ? lval_vec_items(source) : source->cell;
+	int count = source->type == LVAL_VEC ? lval_vec_len(source) : source->count;
+	// Nothing else holds the start of a sequence, so pulled nodes are freed
+	lseq* seq = NULL;
+	if (source->type == LVAL_SEQ) {
+		seq = lseq_of(source);
+		source = NULL;
+	}
+
+	for (int n = 0; !stop && acc->type != LVAL_ERR; n++) {
+		lval* x;
+		if (seq) {
+			lval* err = lseq_force(env, seq);
+			if (err) {
+				lval_del(acc);
+				acc = err;
+				break;
+			}
+			if (!seq->first) { break; }
+			x = lval_copy(seq->first);
+			seq = lseq_next(seq);
+		} else {
+			if (n == count) { break; }
+			x = lval_copy(items[n]);
+		}
+
+		for (int i = 0; x && i < xf->count; i++) {
+			lxstage* stage = &xf->stages[i];
+			if (stage->kind == LXFORM_MAP) {
+				x = ljob_call(env, stage->func, x, NULL);
+			} else if (stage->kind == LXFORM_FILTER) {
+				lval* keep = ljob_call(env, stage->func, lval_copy(x), NULL);
+				if (keep->type == LVAL_NUM) {
+					if (!keep->num) {
+						lval_del(x);
+						x = NULL;
+					}
+					lval_del(keep);
+				} else if (keep->type == LVAL_ERR) {
+					lval_del(x);
+					x = keep;
+				} else {
+					lval_del(x);
+					x = lval_err("'xfilter' function returned %s. Expected %s",
+						ltype_name(keep->type), ltype_name(LVAL_NUM));
+					lval_del(keep);
+				}
+			} else {
+				// The item that uses up a take is the last one pulled
+				if (--left[i] == 0) { stop = true; }
+			}
+			if (x && x->type == LVAL_ERR) {
+				lval_del(acc);
+				acc = x;
+				x = NULL;
+			}
+		}
+		if (!x) { continue; }
+
+		if (func) {
+			acc = ljob_call(env, func, acc, x);
+		} else if (acc->type == LVAL_VEC) {
+			lval_vec_push(acc, x);
+		} else {
+			lval_add(acc, x);
+		}
+	}
+	if (seq) { lseq_release(seq); }
+	if (source) { lval_del(source); }
+	free(left);
+	return acc;
+}
+
+lval* builtin_xstage(lenv* env, lval* arg, char* func_name, int kind) {
+	LASSERT_ARGS(arg, 1, func_name);
+	if (kind == LXFORM_TAKE) {
+		LASSERT_TYPE(arg, 0, LVAL_NUM, func_name);
+		LASSERT(arg, arg->cell[0]->num >= 0,
+			"'%s' passed a negative count. Got %li", func_name, arg->cell[0]->num);
+	} else {
+		LASSERT_TYPE(arg, 0, LVAL_FUNC, func_name);
+	}
+	lxform* xf = lxform_new(1);
+	xf->stages[0].kind = kind;
+	if (kind == LXFORM_TAKE) {
+		xf->stages[0].n = arg->cell[0]->num;
+		lval_del(arg);
+	} else {
+		xf->stages[0].func = lval_take(arg, 0);
+	}
+	return lval_xform(xf);
+}
+
+// Transducer applying a function to each item, (xmap f)
+lval* builtin_xmap(lenv* env, lval* arg) {
+	return builtin_xstage(env, arg, "xmap", LXFORM_MAP);
+}
+
+// Transducer keeping the items a function is true for, (xfilter f)
+lval* builtin_xfilter(lenv* env, lval* arg) {
+	return builtin_xstage(env, arg, "xfilter", LXFORM_FILTER);
+}
+
+// Transducer letting the first n items through, then stopping, (xtake n)
+lval* builtin_xtake(lenv* env, lval* arg) {
+	return builtin_xstage(env, arg, "xtake", LXFORM_TAKE);
+}
+
+// Chains transducers, items pass through them from left to right
+lval* builtin_comp(lenv* env, lval* arg) {
+	int count = 0;
+	for (int i = 0; i < arg->count; i++) {
+		LASSERT_TYPE(arg, i, LVAL_XFORM, "comp");
+		count += arg->cell[i]->xform->count;
+	}
+	lxform* xf = lxform_new(count);
+	int n = 0;
+	for (int i = 0; i < arg->count; i++) {
+		lxform* part = arg->cell[i]->xform;
+		for (int j = 0; j < part->count; j++) {
+			xf->stages[n] = part->stages[j];
+			if (part->stages[j].func) {
+				xf->stages[n].func = lval_copy(part->stages[j].func);
+			}
+			n++;
+		}
+	}
+	lval_del(arg);
+	return lval_xform(xf);
+}
+
+// Reduces the items a transducer gives, (transduce xf f init coll)
+lval* builtin_transduce(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 4, "transduce");
+	LASSERT_TYPE(arg, 0, LVAL_XFORM, "transduce");
+	LASSERT_TYPE(arg, 1, LVAL_FUNC, "transduce");
+	LASSERT(arg, lseq_is_source(arg->cell[3]),
+		"'transduce' passed the incorrect type. Got %s, Expected %s",
+		ltype_name(arg->cell[3]->type), ltype_name(LVAL_SEQ));
+	lval* source = lval_pop(arg, 3);
+	lval* acc = lval_pop(arg, 2);
+	lval* result = lxform_run(env, arg->cell[0]->xform, arg->cell[1], acc, source);
+	lval_del(arg);
+	return result;
+}
+
+// Appends the items a transducer gives to a list or vector, (into to xf coll)
+lval* builtin_into(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 3, "into");
+	LASSERT(arg, arg->cell[0]->type == LVAL_QEXPR || arg->cell[0]->type == LVAL_VEC,
+		"'into' passed the incorrect type. Got %s, Expected %s or %s",
+		ltype_name(arg->cell[0]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
+	LASSERT_TYPE(arg, 1, LVAL_XFORM, "into");
+	LASSERT(arg, lseq_is_source(arg->cell[2]),
+		"'into' passed the incorrect type. Got %s, Expected %s",
+		ltype_name(arg->cell[2]->type), ltype_name(LVAL_SEQ));
+	lval* source = lval_pop(arg, 2);
+	lval* acc = lval_pop(arg, 0);
+	// Vectors are shared, so the items go into a new one
+	if (acc->type == LVAL_VEC) {
+		lval* vec = lval_vec();
+		int count = lval_vec_len(acc);
+		lval** items = lval_vec_items(acc);
+		for (int i = 0; i < count; i++) {
+			lval_vec_push(vec, lval_copy(items[i]));
+		}
+		lval_del(acc);
+		acc = vec;
+	}
+	lval* result = lxform_run(env, arg->cell[0]->xform, NULL, acc, source);
+	lval_del(arg);
+	return result;
+}
+
+// FILES
+
+/*
+Files are read a large block at a time into a buffer of their own, and
+lines are cut from the buffer with memchr. Only a line that runs past
+the end of the buffer is copied twice, so reading is close to the speed
+of the disk and memory use does not grow with the file.
+*/
+
+// Bytes read from a file at a time
+#define LFILE_BUFFER (256 * 1024)
+
+/* Opens path for reading, NULL if it can't be */
+lfile* lfile_open(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (!file) { return NULL; }
+	// Reads go straight into the buffer below
+	setvbuf(file, NULL, _IONBF, 0);
+	lfile* f = malloc(sizeof(lfile));
+	f->refs = 1;
+	f->file = file;
+	f->buf = malloc(LFILE_BUFFER);
+	f->pos = 0;
+	f->len = 0;
+	return f;
+}
+
+void lfile_close(lfile* f) {
+	if (!f->file) { return; }
+	fclose(f->file);
+	f->file = NULL;
+	free(f->buf);
+	f->buf = NULL;
+}
+
+void lfile_release(lfile* f) {
+	if (--f->refs > 0) { return; }
+	lfile_close(f);
+	free(f);
+}
+
+/*
+Reads the next line of an open file without its line break. Returns
+NULL at the end of the file, or an error.
+*/
+lval* lfile_read_line(lfile* f) {
+	// A line that runs past the buffer, gathered piece by piece
+	char* line = NULL;
+	int line_len = 0;
+	while (true) {
+		if (f->pos == f->len) {
+			f->pos = 0;
+			f->len = fread(f->buf, 1, LFILE_BUFFER, f->file);
+			if (f->len == 0) {
+				if (ferror(f->file)) {
+					free(line);
+					return lval_err("Could not read file: %s", strerror(errno));
+				}
+				if (!line) { return NULL; }
+				break;
+			}
+		}
+		char* start = f->buf + f->pos;
+		char* end = memchr(start, '\n', f->len - f->pos);
+		int n = end ? end - start : f->len - f->pos;
+		f->pos += end ? n + 1 : n;
+		// Most lines are within the buffer and copied once
+		if (end && !line) {
+			if (n > 0 && start[n - 1] == '\r') { n--; }
+			return lval_str_len(start, n);
+		}
+		line = realloc(line, line_len + n + 1);
+		memcpy(line + line_len, start, n);
+		line_len += n;
+		if (end) { break; }
+	}
+	if (line_len > 0 && line[line_len - 1] == '\r') { line_len--; }
+	line[line_len] = '\0';
+	return lval_str_take(line, line_len);
+}
+
+// Opens a file for reading, (open "path")
+lval* builtin_open(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "open");
+	LASSERT_TYPE(arg, 0, LVAL_STR, "open");
+	lfile* f = lfile_open(arg->cell[0]->str);
+	LASSERT(arg, f, "Could not open file %s: %s", arg->cell[0]->str, strerror(errno));
+	lval_del(arg);
+	return lval_file(f);
+}
+
+// Reads the next line of a file, {} at its end, (read-line file)
+lval* builtin_read_line(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "read-line");
+	LASSERT_TYPE(arg, 0, LVAL_FILE, "read-line");
+	lfile* f = arg->cell[0]->file;
+	LASSERT(arg, f->file, "'read-line' passed a closed file");
+	lval* line = lfile_read_line(f);
+	lval_del(arg);
+	return line ? line : lval_qexpr();
+}
+
+/*
+Lazy sequence of the lines of a file, or of the file at a path, which
+is closed once the sequence is no longer referenced. (lines file)
+*/
+lval* builtin_lines(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "lines");
+	lval* file = lval_take(arg, 0);
+	if (file->type == LVAL_STR) {
+		lfile* f = lfile_open(file->str);
+		if (!f) {
+			lval* err = lval_err("Could not open file %s: %s", file->str, strerror(errno));
+			lval_del(file);
+			return err;
+		}
+		lval_del(file);
+		file = lval_file(f);
+	}
+	if (file->type != LVAL_FILE) {
+		lval* err = lval_err("'lines' passed the incorrect type. Got %s, Expected %s",
+			ltype_name(file->type), ltype_name(LVAL_FILE));
+		lval_del(file);
+		return err;
+	}
+	return lval_seq(lseq_new(LSEQ_LINES, NULL, NULL, file));
+}
+
+// Closes a file, reading it afterwards is an error, (close file)
+lval* builtin_close(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "close");
+	LASSERT_TYPE(arg, 0, LVAL_FILE, "close");
+	lfile_close(arg->cell[0]->file);
+	lval_del(arg);
+	return lval_sexpr();
+}
+
+// DATA FORMATS
+
+/*
+JSON and CSV are read by hand-written single pass parsers straight into
+lists, strings, numbers and maps. Quotes, backslashes, commas and line
+breaks are found with memchr, which libc vectorizes, so the bytes in
+between are skipped many at a time and copied once.
+*/
+
+// Deepest nesting of JSON arrays and objects read
+#define LJSON_DEPTH 1000
+
+// Text being read
+typedef struct lreader {
+	char* start;
+	char* p;
+	char* end;
+	int depth;
+} lreader;
+
+/* Reads the rest of an open file into a string, or an error */
+lval* lfile_read_all(lfile* f) {
+	lval* all = lval_sbuf(f->buf + f->pos, f->len - f->pos);
+	f->pos = f->len = 0;
+	int n;
+	while ((n = fread(f->buf, 1, LFILE_BUFFER, f->file)) > 0) {
+		lval_sbuf_add(all, f->buf, n);
+	}
+	lval* x = ferror(f->file)
+		? lval_err("Could not read file: %s", strerror(errno))
+		: lval_str_len(all->sbuf->data, all->sbuf->len);
+	lval_del(all);
+	return x;
+}
+
+/*
+Text of the arguement of a parser, a string or an open file read to
+its end. Returns NULL, or an error for anything else.
+*/
+lval* ltext_arg(lval* arg, char* func_name) {
+	if (arg->count != 1) {
+		return lval_err("'%s' has too many arguments. Got %i, Expected %i",
+			func_name, arg->count, 1);
+	}
+	lval* x = arg->cell[0];
+	if (x->type == LVAL_FILE) {
+		if (!x->file->file) { return lval_err("'%s' passed a closed file", func_name); }
+		arg->cell[0] = lfile_read_all(x->file);
+		lval_del(x);
+		return arg->cell[0]->type == LVAL_ERR ? lval_copy(arg->cell[0]) : NULL;
+	}
+	if (x->type != LVAL_STR) {
+		return lval_err("'%s' passed the incorrect type. Got %s, Expected %s or %s",
+			func_name, ltype_name(x->type), ltype_name(LVAL_STR), ltype_name(LVAL_FILE));
+	}
+	return NULL;
+}
+
+void ljson_skip_space(lreader* r) {
+	while (r->p < r->end
+		&& (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t')) {
+		r->p++;
+	}
+}
+
+lval* ljson_error(lreader* r, char* expected) {
+	return lval_err("'json-parse' expected %s at byte %li", expected, (long)(r->p - r->start));
+}
+
+// Value of a hex digit, or -1
+int ljson_hex(char c) {
+	if (c >= '0' && c <= '9') { return c - '0'; }
+	if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+	if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+	return -1;
+}
+
+// Reads the 4 hex digits of a \u escape at p, -1 if they are not
+long ljson_hex4(char* p, char* end) {
+	if (end - p < 4) { return -1; }
+	long code = 0;
+	for (int i = 0; i < 4; i++) {
+		int digit = ljson_hex(p[i]);
+		if (digit < 0) { return -1; }
+		code = code * 16 + digit;
+	}
+	return code;
+}
+
+// Writes a code point as UTF-8, returns the number of bytes
+int lutf8_put(char* out, long code) {
+	if (code < 0x80) {
+		out[0] = code;
+		return 1;
+	}
+	if (code < 0x800) {
+		out[0] = 0xC0 | (code >> 6);
+		out[1] = 0x80 | (code & 0x3F);
+		return 2;
+	}
+	if (code < 0x10000) {
+		out[0] = 0xE0 | (code >> 12);
+		out[1] = 0x80 | ((code >> 6) & 0x3F);
+		out[2] = 0x80 | (code & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (code >> 18);
+	out[1] = 0x80 | ((code >> 12) & 0x3F);
+	out[2] = 0x80 | ((code >> 6) & 0x3F);
+	out[3] = 0x80 | (code & 0x3F);
+	return 4;
+}
+
+lval* ljson_string(lreader* r) {
+	char* start = ++r->p;
+	// The closing quote is the first one not escaped by a backslash
+	char* quote = start;
+	bool escaped = false;
+	while (true) {
+		quote = memchr(quote, '"', r->end - quote);
+		if (!quote) { return ljson_error(r, "a closing quote"); }
+		int slashes = 0;
+		while (quote - slashes > start && quote[-slashes - 1] == '\\') { slashes++; }
+		if (slashes) { escaped = true; }
+		if (slashes % 2 == 0) { break; }
+		quote++;
+	}
+	if (!escaped && !memchr(start, '\\', quote - start)) {
+		r->p = quote + 1;
+		return lval_str_len(start, quote - start);
+	}
+
+	// Unescaped text is never longer than the escaped text
+	char* out = malloc(quote - start + 1);
+	int len = 0;
+	char* p = start;
+	while (p < quote) {
+		char* slash = memchr(p, '\\', quote - p);
+		char* run_end = slash ? slash : quote;
+		memcpy(out + len, p, run_end - p);
+		len += run_end - p;
+		if (!slash) { break; }
+		p = slash + 1;
+		char c = *p++;
+		switch (c) {
+			case '"': case '\\': case '/': out[len++] = c; break;
+			case 'b': out[len++] = '\b'; break;
+			case 'f': out[len++] = '\f'; break;
+			case 'n': out[len++] = '\n'; break;
+			case 'r': out[len++] = '\r'; break;
+			case 't': out[len++] = '\t'; break;
+			case 'u': {
+				long code = ljson_hex4(p, quote);
+				if (code < 0) { goto invalid; }
+				p += 4;
+				// A high surrogate and the low one after it make one code point
+				if (code >= 0xD800 && code < 0xDC00 && quote - p >= 6
+					&& p[0] == '\\' && p[1] == 'u') {
+					long low = ljson_hex4(p + 2, quote);
+					if (low >= 0xDC00 && low < 0xE000) {
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+						p += 6;
+					}
+				}
+				len += lutf8_put(out + len, code);
+				break;
+			}
+			default: goto invalid;
+		}
+	}
+	out[len] = '\0';
+	r->p = quote + 1;
+	return lval_str_take(out, len);
+
+invalid:
+	free(out);
+	r->p = p - 1;
+	return ljson_error(r, "a valid escape");
+}
+
+lval* ljson_number(lreader* r) {
+	char* p = r->p;
+	bool negative = *p == '-';
+	if (negative) { p++; }
+	if (p == r->end || *p < '0' || *p > '9') {
+		r->p = p;
+		return ljson_error(r, "a digit");
+	}
+	long num = 0;
+	while (p < r->end && *p >= '0' && *p <= '9') {
+		// Accumulate negatively so the most negative number fits
+		if (__builtin_mul_overflow(num, 10, &num)
+			|| __builtin_sub_overflow(num, *p - '0', &num)) {
+			return lval_err("'json-parse' number out of range at byte %li",
+				(long)(r->p - r->start));
+		}
+		p++;
+	}
+	if (p < r->end && (*p == '.' || *p == 'e' || *p == 'E')) {
+		return lval_err("'json-parse' numbers must be whole at byte %li",
+			(long)(r->p - r->start));
+	}
+	if (!negative && num == LONG_MIN) {
+		return lval_err("'json-parse' number out of range at byte %li",
+			(long)(r->p - r->start));
+	}
+	r->p = p;
+	return lval_num(negative ? num : -num);
+}
+
+// Whether the text at r starts with word, moving past it if so
+bool lreader_word(lreader* r, char* word) {
+	int len = strlen(word);
+	if (r->end - r->p < len || memcmp(r->p, word, len) != 0) { return false; }
+	r->p += len;
+	return true;
+}
+
+lval* ljson_value(lreader* r);
+
+lval* ljson_array(lreader* r) {
+	r->p++;
+	lval* list = lval_qexpr();
+	ljson_skip_space(r);
+	if (r->p < r->end && *r->p == ']') {
+		r->p++;
+		return list;
+	}
+	while (true) {
+		lval* x = ljson_value(r);
+		if (x->type == LVAL_ERR) {
+			lval_del(list);
+			return x;
+		}
+		lval_add(list, x);
+		ljson_skip_space(r);
+		if (r->p < r->end && *r->p == ',') {
+			r->p++;
+			continue;
+		}
+		if (r->p < r->end && *r->p == ']') {
+			r->p++;
+			return list;
+		}
+		lval_del(list);
+		return ljson_error(r, "',' or ']'");
+	}
+}
+
+lval* ljson_object(lreader* r) {
+	r->p++;
+	lval* map = lval_map();
+	ljson_skip_space(r);
+	if (r->p < r->end && *r->p == '}') {
+		r->p++;
+		return map;
+	}
+	while (true) {
+		ljson_skip_space(r);
+		lval* key = r->p < r->end && *r->p == '"'
+			? ljson_string(r) : ljson_error(r, "a string key");
+		if (key->type == LVAL_ERR) {
+			lval_del(map);
+			return key;
+		}
+		ljson_skip_space(r);
+		if (r->p == r->end || *r->p != ':') {
+			lval_del(key);
+			lval_del(map);
+			return ljson_error(r, "':'");
+		}
+		r->p++;
+		lval* x = ljson_value(r);
+		if (x->type == LVAL_ERR) {
+			lval_del(key);
+			lval_del(map);
+			return x;
+		}
+		lmap_put(map->map, key, x);
+		ljson_skip_space(r);
+		if (r->p < r->end && *r->p == ',') {
+			r->p++;
+			continue;
+		}
+		if (r->p < r->end && *r->p == '}') {
+			r->p++;
+			return map;
+		}
+		lval_del(map);
+		return ljson_error(r, "',' or '}'");
+	}
+}
+
+lval* ljson_value(lreader* r) {
+	ljson_skip_space(r);
+	if (r->p == r->end) { return ljson_error(r, "a value"); }
+	switch (*r->p) {
+		case '"': return ljson_string(r);
+		case '[':
+		case '{': {
+			if (r->depth == LJSON_DEPTH) {
+				return lval_err("'json-parse' nested deeper than %i at byte %li",
+					LJSON_DEPTH, (long)(r->p - r->start));
+			}
+			r->depth++;
+			lval* x = *r->p == '[' ? ljson_array(r) : ljson_object(r);
+			r->depth--;
+			return x;
+		}
+	}
+	if (*r->p == '-' || (*r->p >= '0' && *r->p <= '9')) { return ljson_number(r); }
+	// true and false are 1 and 0 like the stdlib's, null is nil
+	if (lreader_word(r, "true")) { return lval_num(1); }
+	if (lreader_word(r, "false")) { return lval_num(0); }
+	if (lreader_word(r, "null")) { return lval_qexpr(); }
+	return ljson_error(r, "a value");
+}
+
+/*
+Reads JSON from a string or file. Objects become maps, arrays lists,
+true and false 1 and 0, and null {}. Numbers must be whole.
+*/
+lval* builtin_json_parse(lenv* env, lval* arg) {
+	lval* err = ltext_arg(arg, "json-parse");
+	if (err) {
+		lval_del(arg);
+		return err;
+	}
+	lval* text = arg->cell[0];
+	lreader r = { text->str, text->str, text->str + text->str_len, 0 };
+	lval* x = ljson_value(&r);
+	ljson_skip_space(&r);
+	if (x->type != LVAL_ERR && r.p != r.end) {
+		lval_del(x);
+		x = ljson_error(&r, "the end of the text");
+	}
+	lval_del(arg);
+	return x;
+}
+
+// Appends a string to a builder in JSON's quotes and escapes
+void ljson_emit_str(lval* out, char* str, int len) {
+	static const char* hex = "0123456789abcdef";
+	lval_sbuf_add(out, "\"", 1);
+	int run = 0;
+	for (int i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		if (c >= 0x20 && c != '"' && c != '\\') { continue; }
+		lval_sbuf_add(out, str + run, i - run);
+		run = i + 1;
+		char escape[6] = { '\\', c, 0, 0, 0, 0 };
+		int escape_len = 2;
+		switch (c) {
+			case '"': case '\\': break;
+			case '\b': escape[1] = 'b'; break;
+			case '\f': escape[1] = 'f'; break;
+			case '\n': escape[1] = 'n'; break;
+			case '\r': escape[1] = 'r'; break;
+			case '\t': escape[1] = 't'; break;
+			default:
+				memcpy(escape + 1, "u00", 3);
+				escape[4] = hex[c >> 4];
+				escape[5] = hex[c & 0xF];
+				escape_len = 6;
+		}
+		lval_sbuf_add(out, escape, escape_len);
+	}
+	lval_sbuf_add(out, str + run, len - run);
+	lval_sbuf_add(out, "\"", 1);
+}
+
+/* Appends v as JSON to a builder, returns NULL or an error */
+lval* ljson_emit(lval* out, lval* v) {
+	char buffer[21];
+	switch (v->type) {
+		case LVAL_NUM:
+			lval_sbuf_add(out, buffer, lfmt_num(buffer, v->num));
+			return NULL;
+		case LVAL_STR:
+			ljson_emit_str(out, v->str, v->str_len);
+			return NULL;
+		case LVAL_SBUF:
+			ljson_emit_str(out, v->sbuf->data, v->sbuf->len);
+			return NULL;
+		case LVAL_QEXPR:
+		case LVAL_VEC: {
+			int count = v->type == LVAL_VEC ? lval_vec_len(v) : v->count;
+			lval** items = v->type == LVAL_VEC ? lval_vec_items(v) : v->cell;
+			lval_sbuf_add(out, "[", 1);
+			for (int i = 0; i < count; i++) {
+				if (i) { lval_sbuf_add(out, ",", 1); }
+				lval* err = ljson_emit(out, items[i]);
+				if (err) { return err; }
+			}
+			lval_sbuf_add(out, "]", 1);
+			return NULL;
+		}
+		case LVAL_MAP: {
+			lval_sbuf_add(out, "{", 1);
+			bool first = true;
+			for (int t = 0; t < 2; t++) {
+				lmap_table* table = &v->map->tables[t];
+				for (unsigned long i = 0; i < table->size; i++) {
+					for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+						if (!first) { lval_sbuf_add(out, ",", 1); }
+						first = false;
+						// JSON keys are strings, so number keys are written as one
+						if (e->key->type == LVAL_STR) {
+							ljson_emit_str(out, e->key->str, e->key->str_len);
+						} else if (e->key->type == LVAL_NUM) {
+							ljson_emit_str(out, buffer, lfmt_num(buffer, e->key->num));
+						} else {
+							return lval_err("'json-emit' can't write a %s key",
+								ltype_name(e->key->type));
+						}
+						lval_sbuf_add(out, ":", 1);
+						lval* err = ljson_emit(out, e->val);
+						if (err) { return err; }
+					}
+				}
+			}
+			lval_sbuf_add(out, "}", 1);
+			return NULL;
+		}
+	}
+	return lval_err("'json-emit' can't write a %s", ltype_name(v->type));
+}
+
+// Writes a value as JSON text, (json-emit x)
+lval* builtin_json_emit(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "json-emit");
+	lval* out = lval_sbuf("", 0);
+	lval* err = ljson_emit(out, arg->cell[0]);
+	lval* x = err ? err : lval_str_len(out->sbuf->data, out->sbuf->len);
+	lval_del(out);
+	lval_del(arg);
+	return x;
+}
+
+/*
+Reads one CSV field at r. more is set when a comma follows it, which
+is moved past.
+*/
+lval* lcsv_field(lreader* r, char* line_end, bool* more) {
+	if (r->p < line_end && *r->p == '"') {
+		// "" within quotes is a quote, and anything else is kept as it is
+		lval* field = lval_sbuf("", 0);
+		char* p = r->p + 1;
+		while (true) {
+			char* quote = memchr(p, '"', r->end - p);
+			if (!quote) {
+				lval_del(field);
+				return lval_err("'csv-read' expected a closing quote at byte %li",
+					(long)(r->p - r->start));
+			}
+			lval_sbuf_add(field, p, quote - p);
+			p = quote + 1;
+			if (p < r->end && *p == '"') {
+				lval_sbuf_add(field, "\"", 1);
+				p++;
+				continue;
+			}
+			break;
+		}
+		r->p = p;
+		*more = p < r->end && *p == ',';
+		if (!*more && p < r->end && *p != '\r' && *p != '\n') {
+			lval_del(field);
+			return lval_err("'csv-read' expected ',' or a line break at byte %li",
+				(long)(p - r->start));
+		}
+		if (*more) { r->p++; }
+		lval* x = lval_str_len(field->sbuf->data, field->sbuf->len);
+		lval_del(field);
+		return x;
+	}
+	char* comma = memchr(r->p, ',', line_end - r->p);
+	char* field_end = comma ? comma : line_end;
+	lval* x = lval_str_len(r->p, field_end - r->p);
+	r->p = comma ? comma + 1 : line_end;
+	*more = comma != NULL;
+	return x;
+}
+
+/*
+Reads CSV from a string or file into a list of rows, each a list of
+its fields as strings. Fields may be quoted to hold commas, quotes and
+line breaks.
+*/
+lval* builtin_csv_read(lenv* env, lval* arg) {
+	lval* err = ltext_arg(arg, "csv-read");
+	if (err) {
+		lval_del(arg);
+		return err;
+	}
+	lval* text = arg->cell[0];
+	lreader r = { text->str, text->str, text->str + text->str_len, 0 };
+	lval* rows = lval_qexpr();
+	while (r.p < r.end) {
+		lval* row = lval_qexpr();
+		bool more = true;
+		while (more) {
+			// A quoted field may hold line breaks, so the end of the line
+			// is found again for each field
+			char* line_end = memchr(r.p, '\n', r.end - r.p);
+			if (!line_end) { line_end = r.end; }
+			if (line_end > r.p && line_end[-1] == '\r') { line_end--; }
+			lval* field = lcsv_field(&r, line_end, &more);
+			if (field->type == LVAL_ERR) {
+				lval_del(row);
+				lval_del(rows);
+				lval_del(arg);
+				return field;
+			}
+			lval_add(row, field);
+		}
+		lval_add(rows, row);
+		if (r.p < r.end && *r.p == '\r') { r.p++; }
+		if (r.p < r.end && *r.p == '\n') { r.p++; }
+	}
+	lval_del(arg);
+	return rows;
+}
+
+// Appends a CSV field, quoted when it holds a comma, quote or line break
+void lcsv_emit_field(lval* out, char* str, int len) {
+	bool quoted = false;
+	for (int i = 0; i < len && !quoted; i++) {
+		quoted = str[i] == ',' || str[i] == '"' || str[i] == '\n' || str[i] == '\r';
+	}
+	if (!quoted) {
+		lval_sbuf_add(out, str, len);
+		return;
+	}
+	lval_sbuf_add(out, "\"", 1);
+	char* p = str;
+	char* end = str + len;
+	char* quote;
+	while ((quote = memchr(p, '"', end - p))) {
+		lval_sbuf_add(out, p, quote - p + 1);
+		lval_sbuf_add(out, "\"", 1);
+		p = quote + 1;
+	}
+	lval_sbuf_add(out, p, end - p);
+	lval_sbuf_add(out, "\"", 1);
+}
+
+// Writes a list of rows of strings or numbers as CSV text, (csv-write rows)
+lval* builtin_csv_write(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "csv-write");
+	LASSERT(arg, arg->cell[0]->type == LVAL_QEXPR || arg->cell[0]->type == LVAL_VEC,
+		"'csv-write' passed the incorrect type. Got %s, Expected %s",
+		ltype_name(arg->cell[0]->type), ltype_name(LVAL_QEXPR));
+	lval* rows = arg->cell[0];
+	int count = rows->type == LVAL_VEC ? lval_vec_len(rows) : rows->count;
+	lval** items = rows->type == LVAL_VEC ? lval_vec_items(rows) : rows->cell;
+	lval* out = lval_sbuf("", 0);
+	char buffer[21];
+	for (int i = 0; i < count; i++) {
+		lval* row = items[i];
+		if (row->type != LVAL_QEXPR && row->type != LVAL_VEC) {
+			lval_del(out);
+			lval* err = lval_err("'csv-write' passed a row that is a %s", ltype_name(row->type));
+			lval_del(arg);
+			return err;
+		}
+		int fields = row->type == LVAL_VEC ? lval_vec_len(row) : row->count;
+		lval** cells = row->type == LVAL_VEC ? lval_vec_items(row) : row->cell;
+		for (int j = 0; j < fields; j++) {
+			if (j) { lval_sbuf_add(out, ",", 1); }
+			lval* x = cells[j];
+			if (x->type == LVAL_STR) {
+				lcsv_emit_field(out, x->str, x->str_len);
+			} else if (x->type == LVAL_NUM) {
+				lval_sbuf_add(out, buffer, lfmt_num(buffer, x->num));
+			} else {
+				lval_del(out);
+				lval* err = lval_err("'csv-write' can't write a %s field", ltype_name(x->type));
+				lval_del(arg);
+				return err;
+			}
+		}
+		lval_sbuf_add(out, "\n", 1);
+	}
+	lval* x = lval_str_len(out->sbuf->data, out->sbuf->len);
+	lval_del(out);
+	lval_del(arg);
+	return x;
+}
+
+// SERIALIZATION
+
+/*
+Values are encoded as a header of "LSPB" and a version byte, a table of
+the symbols used, and then the value itself. Each value is a tag byte
+followed by its contents: numbers as zigzag varints, strings as a
+varint length and their bytes, symbols as their number in the table,
+lists, vectors and maps as a varint count and their items. Builtins are
+written as the name they are bound to globally, lambdas as their bound
+arguements, formals and body.
+
+Decoding reads the bytes in place, so it can run straight from a file
+mapped into memory.
+*/
+
+#define LBIN_VERSION 1
+
+// Deepest nesting of values encoded or decoded
+#define LBIN_DEPTH 1000
+
+enum lbin_tags {
+	LBIN_NUM, LBIN_STR, LBIN_ERR, LBIN_SYM, LBIN_SEXPR, LBIN_QEXPR,
+	LBIN_VEC, LBIN_MAP, LBIN_SBUF, LBIN_BUILTIN, LBIN_LAMBDA
+};
+
+// Flags of an encoded lambda
+#define LBIN_MACRO 1
+
+typedef struct lbin_writer {
+	// Encoded value and symbol table, both string builders
+	lval* out;
+	lval* syms;
+	// Map of interned symbol names, as numbers, to their number in the table
+	lval* index;
+	long count;
+	lenv* env;
+} lbin_writer;
+
+void lbin_put_byte(lval* out, int byte) {
+	char c = byte;
+	lval_sbuf_add(out, &c, 1);
+}
+
+void lbin_put_varint(lval* out, unsigned long n) {
+	char bytes[10];
+	int len = 0;
+	while (n >= 0x80) {
+		bytes[len++] = (n & 0x7F) | 0x80;
+		n >>= 7;
+	}
+	bytes[len++] = n;
+	lval_sbuf_add(out, bytes, len);
+}
+
+void lbin_put_bytes(lval* out, char* bytes, int len) {
+	lbin_put_varint(out, len);
+	lval_sbuf_add(out, bytes, len);
+}
+
+// Number of a symbol in the table, adding it the first time
+long lbin_sym_index(lbin_writer* w, const char* sym) {
+	lval* key = lval_num((long)sym);
+	lval* found = lmap_get(w->index->map, key);
+	if (found) {
+		lval_del(key);
+		return found->num;
+	}
+	lbin_put_bytes(w->syms, (char*)sym, strlen(sym));
+	lmap_put(w->index->map, key, lval_num(w->count));
+	return w->count++;
+}
+
+// Name a builtin is bound to in the global environment, or NULL
+char* lbin_builtin_name(lenv* env, lbuiltin builtin) {
+	while (env->parent) { env = env->parent; }
+	for (int i = 0; i < env->count; i++) {
+		if (env->vals[i]->type == LVAL_FUNC && env->vals[i]->builtin == builtin) {
+			return env->syms[i];
+		}
+	}
+	return NULL;
+}
+
+/* Encodes v, returns NULL or an error */
+lval* lbin_write(lbin_writer* w, lval* v, int depth) {
+	if (depth == LBIN_DEPTH) {
+		return lval_err("'serialize' passed a value nested deeper than %i", LBIN_DEPTH);
+	}
+	lval* out = w->out;
+	int count;
+	lval** items;
+	switch (v->type) {
+		case LVAL_NUM:
+			lbin_put_byte(out, LBIN_NUM);
+			lbin_put_varint(out, ((unsigned long)v->num << 1) ^ (unsigned long)(v->num >> 63));
+			return NULL;
+		case LVAL_STR:
+			lbin_put_byte(out, LBIN_STR);
+			lbin_put_bytes(out, v->str, v->str_len);
+			return NULL;
+		case LVAL_ERR:
+			lbin_put_byte(out, LBIN_ERR);
+			lbin_put_bytes(out, v->err, strlen(v->err));
+			return NULL;
+		case LVAL_SBUF:
+			lbin_put_byte(out, LBIN_SBUF);
+			lbin_put_bytes(out, v->sbuf->data, v->sbuf->len);
+			return NULL;
+		case LVAL_SYM:
+			lbin_put_byte(out, LBIN_SYM);
+			lbin_put_varint(out, lbin_sym_index(w, v->sym));
+			return NULL;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+		case LVAL_VEC:
+			lbin_put_byte(out, v->type == LVAL_SEXPR ? LBIN_SEXPR
+				: v->type == LVAL_QEXPR ? LBIN_QEXPR : LBIN_VEC);
+			count = v->type == LVAL_VEC ? lval_vec_len(v) : v->count;
+			items = v->type == LVAL_VEC ? lval_vec_items(v) : v->cell;
+			lbin_put_varint(out, count);
+			for (int i = 0; i < count; i++) {
+				lval* err = lbin_write(w, items[i], depth + 1);
+				if (err) { return err; }
+			}
+			return NULL;
+		case LVAL_MAP:
+			lbin_put_byte(out, LBIN_MAP);
+			lbin_put_varint(out, v->map->tables[0].used + v->map->tables[1].used);
+			for (int t = 0; t < 2; t++) {
+				lmap_table* table = &v->map->tables[t];
+				for (unsigned long i = 0; i < table->size; i++) {
+					for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+						lval* err = lbin_write(w, e->key, depth + 1);
+						if (!err) { err = lbin_write(w, e->val, depth + 1); }
+						if (err) { return err; }
+					}
+				}
+			}
+			return NULL;
+		case LVAL_FUNC: {
+			if (v->builtin) {
+				char* name = lbin_builtin_name(w->env, v->builtin);
+				if (!name) { return lval_err("'serialize' passed a builtin with no global name"); }
+				lbin_put_byte(out, LBIN_BUILTIN);
+				lbin_put_varint(out, lbin_sym_index(w, name));
+				return NULL;
+			}
+			lbin_put_byte(out, LBIN_LAMBDA);
+			lbin_put_byte(out, v->macro ? LBIN_MACRO : 0);
+			// The name is symbol number + 1, 0 for none
+			lbin_put_varint(out, v->name ? lbin_sym_index(w, v->name) + 1 : 0);
+			// Arguements bound by partial application
+			lbin_put_varint(out, v->env->count);
+			for (int i = 0; i < v->env->count; i++) {
+				lbin_put_varint(out, lbin_sym_index(w, v->env->syms[i]));
+				lval* err = lbin_write(w, v->env->vals[i], depth + 1);
+				if (err) { return err; }
+			}
+			lval* err = lbin_write(w, v->formals, depth + 1);
+			if (!err) { err = lbin_write(w, v->body, depth + 1); }
+			return err;
+		}
+	}
+	return lval_err("'serialize' can't encode a %s", ltype_name(v->type));
+}
+
+/* Encodes v into a string builder, or returns an error */
+lval* lbin_encode(lenv* env, lval* v) {
+	lbin_writer w = { lval_sbuf("", 0), lval_sbuf("", 0), lval_map(), 0, env };
+	lval* err = lbin_write(&w, v, 0);
+	lval* result = err;
+	if (!err) {
+		result = lval_sbuf("LSPB", 4);
+		lbin_put_byte(result, LBIN_VERSION);
+		lbin_put_varint(result, w.count);
+		lval_sbuf_add(result, w.syms->sbuf->data, w.syms->sbuf->len);
+		lval_sbuf_add(result, w.out->sbuf->data, w.out->sbuf->len);
+	}
+	lval_del(w.out);
+	lval_del(w.syms);
+	lval_del(w.index);
+	return result;
+}
+
+typedef struct lbin_reader {
+	unsigned char* p;
+	unsigned char* end;
+	// Symbol table, names interned from the data
+	const char** syms;
+	long count;
+	lenv* env;
+} lbin_reader;
+
+// Reads a varint into n, false if the data ends first or it is too long
+bool lbin_get_varint(lbin_reader* r, unsigned long* n) {
+	*n = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (r->p == r->end) { return false; }
+		unsigned char byte = *r->p++;
+		*n |= (unsigned long)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) { return true; }
+	}
+	return false;
+}
+
+// Reads a length and finds that many bytes, false if the data ends first
+bool lbin_get_bytes(lbin_reader* r, char** bytes, int* len) {
+	unsigned long n;
+	if (!lbin_get_varint(r, &n) || n > (unsigned long)(r->end - r->p) || n > INT_MAX) {
+		return false;
+	}
+	*bytes = (char*)r->p;
+	*len = n;
+	r->p += n;
+	return true;
+}
+
+// Reads the number of a symbol into its name, false if there is none
+bool lbin_get_sym(lbin_reader* r, const char** sym) {
+	unsigned long n;
+	if (!lbin_get_varint(r, &n) || n >= (unsigned long)r->count) { return false; }
+	*sym = r->syms[n];
+	return true;
+}
+
+lval* lbin_truncated(void) {
+	return lval_err("'deserialize' passed truncated or corrupt data");
+}
+
+/* Decodes one value, or returns an error */
+lval* lbin_read(lbin_reader* r, int depth) {
+	if (depth == LBIN_DEPTH || r->p == r->end) { return lbin_truncated(); }
+	int tag = *r->p++;
+	unsigned long n;
+	char* bytes;
+	const char* sym;
+	int len;
+	switch (tag) {
+		case LBIN_NUM:
+			if (!lbin_get_varint(r, &n)) { return lbin_truncated(); }
+			return lval_num((long)(n >> 1) ^ -(long)(n & 1));
+		case LBIN_STR:
+		case LBIN_ERR:
+		case LBIN_SBUF:
+			if (!lbin_get_bytes(r, &bytes, &len)) { return lbin_truncated(); }
+			if (tag == LBIN_STR) { return lval_str_len(bytes, len); }
+			if (tag == LBIN_SBUF) { return lval_sbuf(bytes, len); }
+			return lval_err("%.*s", len, bytes);
+		case LBIN_SYM:
+			if (!lbin_get_sym(r, &sym)) { return lbin_truncated(); }
+			return lval_sym_interned(sym);
+		case LBIN_SEXPR:
+		case LBIN_QEXPR:
+		case LBIN_VEC:
+		case LBIN_MAP: {
+			// Every item takes at least a byte, which bounds the count
+			if (!lbin_get_varint(r, &n) || n > (unsigned long)(r->end - r->p)) {
+				return lbin_truncated();
+			}
+			lval* x = tag == LBIN_SEXPR ? lval_sexpr() : tag == LBIN_QEXPR ? lval_qexpr()
+				: tag == LBIN_VEC ? lval_vec() : lval_map();
+			for (unsigned long i = 0; i < n; i++) {
+				lval* item = lbin_read(r, depth + 1);
+				if (item->type == LVAL_ERR && tag != LBIN_MAP) {
+					lval_del(x);
+					return item;
+				}
+				if (tag == LBIN_MAP) {
+					lval* val = item->type == LVAL_ERR ? item : lbin_read(r, depth + 1);
+					if (val->type == LVAL_ERR) {
+						if (val != item) { lval_del(item); }
+						lval_del(x);
+						return val;
+					}
+					lmap_put(x->map, item, val);
+				} else if (tag == LBIN_VEC) {
+					lval_vec_push(x, item);
+				} else {
+					lval_add(x, item);
+				}
+			}
+			return x;
+		}
+		case LBIN_BUILTIN: {
+			if (!lbin_get_sym(r, &sym)) { return lbin_truncated(); }
+			lval* k = lval_sym_interned(sym);
+			lval* x = lenv_get(r->env, k);
+			lval_del(k);
+			if (x->type != LVAL_FUNC || !x->builtin) {
+				lval_del(x);
+				return lval_err("'deserialize' found no builtin named %s", sym);
+			}
+			return x;
+		}
+		case LBIN_LAMBDA: {
+			if (r->p == r->end) { return lbin_truncated(); }
+			int flags = *r->p++;
+			unsigned long name;
+			if (!lbin_get_varint(r, &name) || name > (unsigned long)r->count) {
+				return lbin_truncated();
+			}
+			if (!lbin_get_varint(r, &n) || n > (unsigned long)(r->end - r->p)) {
+				return lbin_truncated();
+			}
+			// Bound arguements are kept aside until the lambda is made
+			lval* bound = lval_qexpr();
+			for (unsigned long i = 0; i < n; i++) {
+				lval* x = lbin_get_sym(r, &sym) ? lbin_read(r, depth + 1) : lbin_truncated();
+				if (x->type == LVAL_ERR) {
+					lval_del(bound);
+					return x;
+				}
+				lval_add(bound, lval_sym_interned(sym));
+				lval_add(bound, x);
+			}
+			lval* formals = lbin_read(r, depth + 1);
+			lval* body = formals->type == LVAL_ERR ? lval_sexpr() : lbin_read(r, depth + 1);
+			bool valid = formals->type == LVAL_QEXPR && body->type == LVAL_QEXPR;
+			for (int i = 0; valid && i < formals->count; i++) {
+				valid = formals->cell[i]->type == LVAL_SYM;
+			}
+			if (!valid) {
+				lval* err = formals->type == LVAL_ERR ? formals
+					: body->type == LVAL_ERR ? body : lbin_truncated();
+				if (err != formals) { lval_del(formals); }
+				if (err != body) { lval_del(body); }
+				lval_del(bound);
+				return err;
+			}
+			/*
+			Made like any lambda, so its body is folded and cached too.
+			Bound arguements count as formals while folding, then are dropped.
+			*/
+			lval* all = lval_qexpr();
+			for (int i = 0; i < bound->count; i += 2) {
+				lval_add(all, lval_copy(bound->cell[i]));
+			}
+			while (formals->count) { lval_add(all, lval_pop(formals, 0)); }
+			lval_del(formals);
+			lval* x = builtin_lambda(r->env, lval_add(lval_add(lval_sexpr(), all), body));
+			if (x->type != LVAL_ERR) {
+				x->macro = flags & LBIN_MACRO;
+				if (name) { x->name = r->syms[name - 1]; }
+				for (int i = 0; i < bound->count; i += 2) {
+					lval_del(lval_pop(x->formals, 0));
+					lenv_put(x->env, bound->cell[i], bound->cell[i + 1]);
+				}
+			}
+			lval_del(bound);
+			return x;
+		}
+	}
+	return lval_err("'deserialize' found an unknown tag %i", tag);
+}
+
+/* Decodes the value at the start of len bytes of data, or returns an error */
+lval* lbin_decode(lenv* env, char* data, long len, long* used) {
+	// Builtins are looked up and lambdas made in the global environment
+	while (env->parent) { env = env->parent; }
+	lbin_reader r = { (unsigned char*)data, (unsigned char*)data + len, NULL, 0, env };
+	if (len < 5 || memcmp(data, "LSPB", 4) != 0) {
+		return lval_err("'deserialize' passed data that is not serialized lispa");
+	}
+	if (data[4] != LBIN_VERSION) {
+		return lval_err("'deserialize' passed data of version %i. Expected %i",
+			data[4], LBIN_VERSION);
+	}
+	r.p += 5;
+	unsigned long count;
+	if (!lbin_get_varint(&r, &count) || count > (unsigned long)(r.end - r.p)) {
+		return lbin_truncated();
+	}
+	r.syms = malloc(sizeof(char*) * (count ? count : 1));
+	lval* x = NULL;
+	for (; r.count < (long)count; r.count++) {
+		char* bytes;
+		int n;
+		if (!lbin_get_bytes(&r, &bytes, &n)) {
+			x = lbin_truncated();
+			break;
+		}
+		char* name = malloc(n + 1);
+		memcpy(name, bytes, n);
+		name[n] = '\0';
+		r.syms[r.count] = lname_intern(name);
+		free(name);
+	}
+	if (!x) { x = lbin_read(&r, 0); }
+	if (used) { *used = (char*)r.p - data; }
+	free(r.syms);
+	return x;
+}
+
+// Encodes a value as a string of bytes, (serialize x)
+lval* builtin_serialize(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "serialize");
+	lval* encoded = lbin_encode(env, arg->cell[0]);
+	lval_del(arg);
+	if (encoded->type == LVAL_ERR) { return encoded; }
+	lval* x = lval_str_len(encoded->sbuf->data, encoded->sbuf->len);
+	lval_del(encoded);
+	return x;
+}
+
+/*
+Decodes a value from a string, or from an open file at its position.
+Files are mapped into memory and decoded in place, and left just past
+the value so the next one can be read.
+*/
+lval* builtin_deserialize(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "deserialize");
+	lval* x = arg->cell[0];
+	LASSERT(arg, x->type == LVAL_STR || x->type == LVAL_FILE,
+		"'deserialize' passed the incorrect type. Got %s, Expected %s or %s",
+		ltype_name(x->type), ltype_name(LVAL_STR), ltype_name(LVAL_FILE));
+	if (x->type == LVAL_STR) {
+		lval* result = lbin_decode(env, x->str, x->str_len, NULL);
+		lval_del(arg);
+		return result;
+	}
+	lfile* f = x->file;
+	LASSERT(arg, f->file, "'deserialize' passed a closed file");
+
+#ifndef LISPA_NO_MMAP
+	// Where reading got to, less what is buffered but not used yet
+	long start = ftell(f->file) - (f->len - f->pos);
+	struct stat st;
+	LASSERT(arg, start >= 0 && fstat(fileno(f->file), &st) == 0,
+		"Could not read file: %s", strerror(errno));
+	long size = st.st_size;
+	lval* result;
+	if (size <= start) {
+		result = lbin_truncated();
+	} else {
+		char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f->file), 0);
+		LASSERT(arg, data != MAP_FAILED, "Could not map file: %s", strerror(errno));
+		long used = 0;
+		result = lbin_decode(env, data + start, size - start, &used);
+		munmap(data, size);
+		fseek(f->file, start + used, SEEK_SET);
+		f->pos = f->len = 0;
+	}
+#else
+	lval* text = lfile_read_all(f);
+	lval* result = text->type == LVAL_ERR ? lval_copy(text)
+		: lbin_decode(env, text->str, text->str_len, NULL);
+	lval_del(text);
+#endif
+	lval_del(arg);
+	return result;
+}
+
+// MACROS
+
+/*
+A macro is a function called with the forms of its arguements instead
+of their values. It returns the code to evaluate in their place, as a
+Q-Expression or any other value. The expansion is cached on the form
+of the call, so each call site is expanded once. Like inline caches,
+an expansion is dropped when the cache version of the context changes,
+since the macro may have been redefined.
+*/
+struct lexpansion {
+	lval* code;
+	// Global environment and lookup version the expansion is valid for
+	lenv* env;
+	long version;
+	// Cells of the form when it was expanded, appending changes the form
+	int count;
+};
+
+void lexpansion_del(lcells* cells) {
+	lval_del(cells->expansion->code);
+	free(cells->expansion);
+	cells->expansion = NULL;
+}
+
+/* Copy of the expansion cached on v, or NULL when it is stale */
+lval* lmacro_cached(lval* v) {
+	lcells* cells = v->cells;
+	lexpansion* expansion = cells->expansion;
+	if (lctx && expansion->env == lctx->env
+		&& expansion->version == lcache_version_now()
+		&& expansion->count == cells->count) {
+		if (v->cell != cells->items || v->count != cells->count) { return NULL; }
+		return lval_copy(expansion->code);
+	}
+	lexpansion_del(cells);
+	return NULL;
+}
+
+/* Evaluates code a macro expanded to */
+lval* lmacro_eval(lenv* env, lval* code) {
+	if (code->type == LVAL_QEXPR) { code->type = LVAL_SEXPR; }
+	return lval_eval(env, code);
+}
+
+/*
+Expands and evaluates v, a form with the macro evaluated in its first
+cell. site is the shared storage of the form to cache the expansion on,
+or NULL.
+*/
+lval* lmacro_call(lenv* env, lval* v, lcells* site) {
+	long version = lcache_version_now();
+	lval* macro = lval_pop(v, 0);
+	lval* code = lval_call(env, macro, v);
+	lval_del(macro);
+	if (code->type == LVAL_ERR) { return code; }
+
+	// Only cache calls through a global name no lambda binds locally
+	lval* head = site ? site->items[0] : NULL;
+	if (head && lctx && head->type == LVAL_SYM && !lname_bound(head->sym)) {
+		if (site->expansion) { lexpansion_del(site); }
+		site->expansion = malloc(sizeof(lexpansion));
+		site->expansion->code = lval_copy(code);
+		site->expansion->env = lctx->env;
+		site->expansion->version = version;
+		site->expansion->count = site->count;
+	}
+	return lmacro_eval(env, code);
+}
+
+// Defines a macro, (defmacro {name formals...} {body})
+lval* builtin_defmacro(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "defmacro");
+	LASSERT_TYPE(arg, 0, LVAL_QEXPR, "defmacro");
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, "defmacro");
+	LASSERT(arg, arg->cell[0]->count > 0, "'defmacro' passed no name");
+	LASSERT_TYPE(arg->cell[0], 0, LVAL_SYM, "defmacro");
+
+	lval* name = lval_pop(arg->cell[0], 0);
+	lval* macro = builtin_lambda(env, arg);
+	if (macro->type == LVAL_ERR) {
+		lval_del(name);
+		return macro;
+	}
+	macro->macro = true;
+	macro->name = lname_intern(name->sym);
+	lfold_guard(env, name, "def");
+	lenv_def(env, name, macro);
+	lval_del(name);
+	lval_del(macro);
+	return lval_sexpr();
+}
+
+/* Evaluates the value of a case clause, found in a jump table */
+lval* builtin_case_table(lenv* env, lval* arg) {
+	lval* branch = lmap_get(arg->cell[0]->map, arg->cell[1]);
+	if (!branch) {
+		lval_del(arg);
+		return lval_err("No Case Found");
+	}
+	branch = lval_copy(branch);
+	lval_del(arg);
+	return builtin_eval(env, lval_add(lval_sexpr(), branch));
+}
+
+/* Evaluates the keys of case clauses in order until one matches */
+lval* builtin_case_scan(lenv* env, lval* arg) {
+	lval* x = lval_pop(arg, 0);
+	while (arg->count) {
+		lval* clause = lval_pop(arg, 0);
+		if (clause->type != LVAL_QEXPR || clause->count < 2) {
+			lval_del(clause);
+			lval_del(x);
+			lval_del(arg);
+			return lval_err("'case' passed an invalid clause. Expected {key value}");
+		}
+		// Keys and values are evaluated like single item expressions
+		lval* key = lval_copy(clause);
+		lval_truncate(key, 1);
+		key = builtin_eval(env, lval_add(lval_sexpr(), key));
+		if (key->type == LVAL_ERR || lval_equal(x, key)) {
+			lval_del(x);
+			lval_del(arg);
+			if (key->type == LVAL_ERR) {
+				lval_del(clause);
+				return key;
+			}
+			lval_del(key);
+			lval_drop(clause, 1);
+			lval_truncate(clause, 1);
+			return builtin_eval(env, lval_add(lval_sexpr(), clause));
+		}
+		lval_del(key);
+		lval_del(clause);
+	}
+	lval_del(x);
+	lval_del(arg);
+	return lval_err("No Case Found");
+}
+
+/*
+Expands (case x {key value}...). When every key is a number or string
+the clauses become a hash map, so the value is found without comparing
+x to each key in turn.
+*/
+lval* builtin_case(lenv* env, lval* arg) {
+	LASSERT(arg, arg->count > 0, "'case' passed no arguements");
+	bool constant = true;
+	for (int i = 1; i < arg->count; i++) {
+		lval* clause = arg->cell[i];
+		constant = constant && clause->type == LVAL_QEXPR && clause->count >= 2
+			&& (clause->cell[0]->type == LVAL_NUM || clause->cell[0]->type == LVAL_STR);
+	}
+
+	lval* x = lval_pop(arg, 0);
+	lval* code = lval_sexpr();
+	if (!constant) {
+		lval_add(code, lval_func(builtin_case_scan));
+		lval_add(code, x);
+		while (arg->count) { lval_add(code, lval_pop(arg, 0)); }
+		lval_del(arg);
+		return code;
+	}
+
+	lval* table = lval_map();
+	while (arg->count) {
+		lval* clause = lval_pop(arg, 0);
+		// The first clause with a key wins, as when comparing in turn
+		if (!lmap_get(table->map, clause->cell[0])) {
+			lmap_put(table->map, lval_copy(clause->cell[0]),
+				lval_add(lval_qexpr(), lval_copy(clause->cell[1])));
+		}
+		lval_del(clause);
+	}
+	lval_add(code, lval_func(builtin_case_table));
+	lval_add(code, table);
+	lval_add(code, x);
+	lval_del(arg);
+	return code;
+}
+
+// SPECIAL FORMS
+
+/*
+Special forms are builtins given the forms of their arguements, which
+they evaluate themselves in order and only as far as they need to.
+*/
+
+// Evaluates each form in turn, (do x y...) returns the last value
+lval* builtin_do(lenv* env, lval* arg) {
+	lval* result = lval_qexpr();
+	while (arg->count) {
+		lval_del(result);
+		result = lval_eval(env, lval_pop(arg, 0));
+		if (result->type == LVAL_ERR) { break; }
+	}
+	lval_del(arg);
+	return result;
+}
+
+// Evaluates a Q-Expression in a new scope, (let {body})
+lval* builtin_let(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "let");
+	lval* body = lval_eval(env, lval_pop(arg, 0));
+	lval_del(arg);
+	if (body->type == LVAL_ERR) { return body; }
+	if (body->type != LVAL_QEXPR) {
+		lval* err = lval_err("'let' passed the incorrect type. "
+			"Got %s, Expected %s", ltype_name(body->type), ltype_name(LVAL_QEXPR));
+		lval_del(body);
+		return err;
+	}
+	lenv* scope = lenv_new();
+	scope->parent = env;
+	body->type = LVAL_SEXPR;
+	lval* result = lval_eval(scope, body);
+	lenv_del(scope);
+	return result;
+}
+
+/*
+Evaluates the forms of and/or in turn until one is stop, giving stop,
+or !stop if none is
+*/
+lval* lform_logic(lenv* env, lval* arg, char* func_name, bool stop) {
+	bool result = !stop;
+	while (arg->count) {
+		lval* x = lval_eval(env, lval_pop(arg, 0));
+		if (x->type == LVAL_ERR) {
+			lval_del(arg);
+			return x;
+		}
+		if (x->type != LVAL_NUM) {
+			lval* err = lval_err("'%s' passed the incorrect type. "
+				"Got %s, Expected %s", func_name, ltype_name(x->type), ltype_name(LVAL_NUM));
+			lval_del(x);
+			lval_del(arg);
+			return err;
+		}
+		bool truth = x->num != 0;
+		lval_del(x);
+		if (truth == stop) {
+			result = stop;
+			break;
+		}
+	}
+	lval_del(arg);
+	return lval_num(result);
+}
+
+// 1 if every form is true, stops at the first false one
+lval* builtin_and(lenv* env, lval* arg) {
+	return lform_logic(env, arg, "and", false);
+}
+
+// 1 if any form is true, stops at the first true one
+lval* builtin_or(lenv* env, lval* arg) {
+	return lform_logic(env, arg, "or", true);
+}
+
+// FOLDING
+
+/*
+When a lambda is made its body is folded once: calls of pure builtins
+on constants are replaced by their results, the small stdlib helpers
+below are inlined, and ifs with a constant condition are replaced by
+their taken branch. The branches of an if are folded too, other
+Q-Expressions are data and left alone.
+
+A call is folded when its head resolves to the builtin where the lambda
+is made and no lambda binds it as a formal. Defining or putting one of
+the names folding relies on gives the context a new fold_epoch, after
+which lambdas folded before go back to their original body. First
+binding one as a formal is counted in lfold_shadows and does the same
+in every context.
+*/
+
+// Builtins without side effects, safe to run on constants early
+static const struct {
+	const char* name;
+	lbuiltin func;
+} lfold_pure[] = {
+	{ "+", builtin_add }, { "-", builtin_sub },
+	{ "*", builtin_mul }, { "/", builtin_div },
+	{ "==", builtin_equal }, { "!=", builtin_not_equal },
+	{ ">", builtin_gt }, { "<", builtin_le },
+	{ ">=", builtin_ge }, { "<=", builtin_le },
+	{ "list", builtin_list }, { "head", builtin_head },
+	{ "tail", builtin_tail }, { "join", builtin_join },
+	{ "str-cat", builtin_str_cat }, { "str-len", builtin_str_len },
+	{ "substr", builtin_substr }, { "str-find", builtin_str_find },
+	{ "num->str", builtin_num_to_str }, { "str->num", builtin_str_to_num },
+};
+
+#define LFOLD_PURE_COUNT (int)(sizeof(lfold_pure) / sizeof(lfold_pure[0]))
+
+// Stdlib helpers small enough to inline
+static const char* lfold_inline[] = { "not", "fst", "snd" };
+
+#define LFOLD_INLINE_COUNT (int)(sizeof(lfold_inline) / sizeof(lfold_inline[0]))
+
+// Deepest helpers are inlined into each other
+#define LFOLD_DEPTH 8
+
+bool lfold_is_pure(lbuiltin func) {
+	for (int i = 0; i < LFOLD_PURE_COUNT; i++) {
+		if (lfold_pure[i].func == func) { return true; }
+	}
+	return false;
+}
+
+bool lfold_is_inline(const char* name) {
+	if (!name) { return false; }
+	for (int i = 0; i < LFOLD_INLINE_COUNT; i++) {
+		if (strcmp(lfold_inline[i], name) == 0) { return true; }
+	}
+	return false;
+}
+
+// Whether folding may rely on what name is bound to
+bool lfold_relies_on(const char* name) {
+	if (strcmp(name, "if") == 0 || lfold_is_inline(name)) { return true; }
+	for (int i = 0; i < LFOLD_PURE_COUNT; i++) {
+		if (strcmp(lfold_pure[i].name, name) == 0) { return true; }
+	}
+	return false;
+}
+
+/*
+Called before def or = binds sym. Only defining a new global can't
+change what earlier folds relied on.
+*/
+void lfold_guard(lenv* env, lval* sym, char* func_name) {
+	if (!lfold_relies_on(sym->sym)) { return; }
+	if (strcmp(func_name, "def") == 0) {
+		while (env->parent) { env = env->parent; }
+		bool bound = false;
+		for (int i = 0; i < env->count; i++) {
+			if (env->syms[i] == sym->sym) { bound = true; }
+		}
+		if (!bound) { return; }
+	}
+	if (lctx) { lctx->fold_epoch = lctx_version(); }
+}
+
+/*
+Called the first time name is bound outside a global environment. With
+dynamic scope a caller's formal can then stand in for the builtin.
+*/
+void lfold_shadow(const char* name) {
+	if (!lfold_relies_on(name)) { return; }
+	__atomic_fetch_add(&lfold_shadows, 1, __ATOMIC_RELAXED);
+}
+
+bool lfold_is_formal(lval* formals, lval* sym) {
+	for (int i = 0; i < formals->count; i++) {
+		if (formals->cell[i]->sym == sym->sym) { return true; }
+	}
+	return false;
+}
+
+/* The value the head of x has where the lambda is made, or NULL */
+lval* lfold_lookup(lenv* env, lval* formals, lval* x) {
+	if (x->count == 0 || x->cell[0]->type != LVAL_SYM) { return NULL; }
+	if (lfold_is_formal(formals, x->cell[0])) { return NULL; }
+	lval* value = lenv_get(env, x->cell[0]);
+	if (value->type != LVAL_FUNC) {
+		lval_del(value);
+		return NULL;
+	}
+	return value;
+}
+
+/* As lfold_lookup, or NULL when any lambda binds the head locally */
+lval* lfold_head(lenv* env, lval* formals, lval* x) {
+	if (x->count > 0 && x->cell[0]->type == LVAL_SYM
+		&& lname_bound(x->cell[0]->sym)) {
+		return NULL;
+	}
+	return lfold_lookup(env, formals, x);
+}
+
+bool lfold_is_constant(lval* v) {
+	return v->type == LVAL_NUM || v->type == LVAL_STR || v->type == LVAL_QEXPR;
+}
+
+// Whether any of the symbols in syms appears anywhere in x
+bool lfold_mentions(lval* x, lval* syms) {
+	if (x->type == LVAL_SYM) { return lfold_is_formal(syms, x); }
+	if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return false; }
+	for (int i = 0; i < x->count; i++) {
+		if (lfold_mentions(x->cell[i], syms)) { return true; }
+	}
+	return false;
+}
+
+/*
+Checks a helper's body can be inlined: each of its formals is used once
+in evaluation order and never inside a Q-Expression, and no other
+symbol in it is a formal of the lambda being folded.
+*/
+bool lfold_check_uses(lval* x, lval* helper_formals, lval* formals, int* next) {
+	for (int i = 0; i < x->count; i++) {
+		lval* child = x->cell[i];
+		if (child->type == LVAL_SEXPR) {
+			if (!lfold_check_uses(child, helper_formals, formals, next)) { return false; }
+		} else if (child->type == LVAL_QEXPR) {
+			if (lfold_mentions(child, helper_formals)) { return false; }
+		} else if (child->type == LVAL_SYM) {
+			if (lfold_is_formal(helper_formals, child)) {
+				if (*next >= helper_formals->count
+					|| helper_formals->cell[*next]->sym != child->sym) {
+					return false;
+				}
+				(*next)++;
+			} else if (lfold_is_formal(formals, child)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Copies x with the helper's formals replaced by the call's arguements
+lval* lfold_substitute(lval* x, lval* helper_formals, lval* call) {
+	lval* y = lval_sexpr();
+	for (int i = 0; i < x->count; i++) {
+		lval* child = x->cell[i];
+		if (child->type == LVAL_SEXPR) {
+			lval_add(y, lfold_substitute(child, helper_formals, call));
+			continue;
+		}
+		lval* value = NULL;
+		if (child->type == LVAL_SYM) {
+			for (int j = 0; j < helper_formals->count; j++) {
+				if (helper_formals->cell[j]->sym == child->sym) {
+					value = lval_copy(call->cell[j + 1]);
+				}
+			}
+		}
+		lval_add(y, value ? value : lval_copy(child));
+	}
+	return y;
+}
+
+/* Inlines a call of a helper, or returns NULL if it can't be */
+lval* lfold_inline_call(lval* helper, lval* formals, lval* x) {
+	if (!lfold_is_inline(helper->name)) { return NULL; }
+	lval* helper_formals = helper->formals;
+	if (helper_formals->count != x->count - 1) { return NULL; }
+	for (int i = 0; i < helper_formals->count; i++) {
+		if (helper_formals->cell[i]->sym == lname_rest) { return NULL; }
+	}
+	int next = 0;
+	if (!lfold_check_uses(helper->body, helper_formals, formals, &next)
+		|| next != helper_formals->count) {
+		return NULL;
+	}
+	return lfold_substitute(helper->body, helper_formals, x);
+}
+
+lval* lfold_expr(lenv* env, lval* formals, lval* x, int depth);
+
+/*
+Folds a Q-Expression that will be evaluated as an S-Expression, returns
+it as a Q-Expression again
+*/
+lval* lfold_code(lenv* env, lval* formals, lval* code, int depth) {
+	lval* x = lval_copy(code);
+	x->type = LVAL_SEXPR;
+	lval* folded = lfold_expr(env, formals, x, depth);
+	lval_del(x);
+	if (folded->type == LVAL_SEXPR) {
+		folded->type = LVAL_QEXPR;
+		return folded;
+	}
+	// A constant evaluates to itself when it is the only element
+	return lval_add(lval_qexpr(), folded);
+}
+
+/* Returns a folded copy of x, leaving x untouched */
+lval* lfold_expr(lenv* env, lval* formals, lval* x, int depth) {
+	if (x->type != LVAL_SEXPR) { return lval_copy(x); }
+
+	// Macros are given the forms of their arguements as written
+	lval* macro = lfold_lookup(env, formals, x);
+	if (macro && macro->macro) {
+		lval_del(macro);
+		return lval_copy(x);
+	}
+	if (macro) { lval_del(macro); }
+
+	// Fold the arguements first
+	lval* y = lval_sexpr();
+	for (int i = 0; i < x->count; i++) {
+		lval_add(y, lfold_expr(env, formals, x->cell[i], depth));
+	}
+
+	lval* head = lfold_head(env, formals, y);
+	if (!head) { return y; }
+
+	// Branches of an if are code, a constant condition picks one
+	if (head->builtin == builtin_if && y->count == 4
+		&& y->cell[2]->type == LVAL_QEXPR && y->cell[3]->type == LVAL_QEXPR) {
+		for (int i = 2; i < 4; i++) {
+			lval* branch = lfold_code(env, formals, y->cell[i], depth);
+			lval_del(y->cell[i]);
+			y->cell[i] = branch;
+		}
+		if (y->cell[1]->type == LVAL_NUM) {
+			lval* taken = lval_pop(y, y->cell[1]->num ? 2 : 3);
+			lval_del(y);
+			lval_del(head);
+			taken->type = LVAL_SEXPR;
+			// A lone constant needs no S-Expression around it
+			if (taken->count == 1 && (taken->cell[0]->type == LVAL_NUM
+				|| taken->cell[0]->type == LVAL_STR)) {
+				return lval_take(taken, 0);
+			}
+			return taken;
+		}
+		lval_del(head);
+		return y;
+	}
+
+	// Pure builtins on constants are run now, unless they fail
+	if (head->builtin && lfold_is_pure(head->builtin)) {
+		bool constant = true;
+		for (int i = 1; i < y->count; i++) {
+			if (!lfold_is_constant(y->cell[i])) { constant = false; }
+		}
+		if (constant) {
+			lval* args = lval_sexpr();
+			for (int i = 1; i < y->count; i++) {
+				lval_add(args, lval_copy(y->cell[i]));
+			}
+			lval* result = head->builtin(env, args);
+			if (result->type != LVAL_ERR) {
+				lval_del(head);
+				lval_del(y);
+				return result;
+			}
+			lval_del(result);
+		}
+	}
+
+	// Helpers are replaced by their body, then folded again
+	if (!head->builtin && depth < LFOLD_DEPTH) {
+		lval* inlined = lfold_inline_call(head, formals, y);
+		if (inlined) {
+			lval* folded = lfold_expr(env, formals, inlined, depth + 1);
+			lval_del(inlined);
+			lval_del(head);
+			lval_del(y);
+			return folded;
+		}
+	}
+
+	lval_del(head);
+	return y;
+}
+
+/* Folds the body of a lambda, returns NULL if nothing changed */
+lval* lfold_body(lenv* env, lval* formals, lval* body) {
+	lval* folded = lfold_code(env, formals, body, 0);
+	if (lval_equal(folded, body)) {
+		lval_del(folded);
+		return NULL;
+	}
+	return folded;
+}
+
+// JIT
+
+/*
+Lambdas called often whose bodies only use fixnum arithmetic,
+comparisons, if and calls to themselves are compiled to x86-64 machine
+code, a fixed template of instructions per form. Arguements and
+temporaries live in stack slots below rbp, self calls in tail position
+become jumps. The code returns its result in rax with rdx zero, or
+gives up with rdx set, as on a division by zero. The call is then
+evaluated again by the interpreter, which is safe since compiled code
+has no side effects.
+
+Like inline caches, the code relies on the globals it calls staying
+bound to the same values and never being bound locally, so it is
+dropped whenever the cache version of the context changes.
+*/
+
+#ifndef LISPA_NO_JIT
+
+// Calls before a lambda is compiled
+#define LJIT_THRESHOLD 1000
+// Times the code may give up before the lambda stays interpreted
+#define LJIT_DEOPTS 16
+// Most arguements, all passed in registers
+#define LJIT_ARGS 6
+
+enum ljit_states { LJIT_COLD, LJIT_READY, LJIT_FAILED };
+
+enum ljit_forms {
+	LJIT_NONE, LJIT_ADD, LJIT_SUB, LJIT_MUL, LJIT_DIV,
+	LJIT_GT, LJIT_LT, LJIT_GE, LJIT_LE, LJIT_EQ, LJIT_NE,
+	LJIT_IF, LJIT_SELF
+};
+
+// Builtins are matched by function, so a name compiles to what it does
+static const struct {
+	lbuiltin func;
+	int form;
+} ljit_builtins[] = {
+	{ builtin_add, LJIT_ADD }, { builtin_sub, LJIT_SUB },
+	{ builtin_mul, LJIT_MUL }, { builtin_div, LJIT_DIV },
+	{ builtin_gt, LJIT_GT }, { builtin_lt, LJIT_LT },
+	{ builtin_ge, LJIT_GE }, { builtin_le, LJIT_LE },
+	{ builtin_equal, LJIT_EQ }, { builtin_not_equal, LJIT_NE },
+	{ builtin_if, LJIT_IF },
+};
+
+// Register numbers, arguements are passed in the System V order
+enum ljit_regs {
+	LJIT_RAX = 0, LJIT_RCX = 1, LJIT_RDX = 2, LJIT_RSI = 6, LJIT_RDI = 7,
+	LJIT_R8 = 8, LJIT_R9 = 9
+};
+static const int ljit_arg_regs[LJIT_ARGS] = {
+	LJIT_RDI, LJIT_RSI, LJIT_RDX, LJIT_RCX, LJIT_R8, LJIT_R9
+};
+
+typedef struct ljit_result {
+	long value;
+	long deopt;
+} ljit_result;
+typedef ljit_result (*ljit_code)(long, long, long, long, long, long);
+
+static bool ljit_enabled = true;
+
+ljit* ljit_new(void) {
+	ljit* jit = calloc(1, sizeof(ljit));
+	jit->refs = 1;
+	return jit;
+}
+
+// Drops the code and starts counting calls again
+void ljit_reset(ljit* jit) {
+	if (jit->code) { munmap(jit->code, jit->size); }
+	jit->code = NULL;
+	jit->state = LJIT_COLD;
+	jit->calls = 0;
+	jit->deopts = 0;
+}
+
+void ljit_release(ljit* jit) {
+	if (--jit->refs == 0) {
+		ljit_reset(jit);
+		free(jit);
+	}
+}
+
+typedef struct ljit_asm {
+	unsigned char* code;
+	int len;
+	int capacity;
+	// Lambda being compiled
+	lval* func;
+	int nargs;
+	// Stack slots used, the arguements' first
+	int slots;
+	// Where the body starts, after the prologue
+	int body;
+	// Jumps to the exit giving up
+	int* exits;
+	int exit_count;
+	bool failed;
+} ljit_asm;
+
+void ljit_byte(ljit_asm* a, int byte) {
+	if (a->len == a->capacity) {
+		a->capacity = a->capacity ? a->capacity * 2 : 256;
+		a->code = realloc(a->code, a->capacity);
+	}
+	a->code[a->len++] = byte;
+}
+
+void ljit_bytes(ljit_asm* a, const char* bytes, int n) {
+	for (int i = 0; i < n; i++) { ljit_byte(a, (unsigned char)bytes[i]); }
+}
+
+void ljit_imm(ljit_asm* a, long imm, int n) {
+	for (int i = 0; i < n; i++) { ljit_byte(a, (imm >> (8 * i)) & 0xFF); }
+}
+
+// mov between reg and a stack slot, op is 0x89 to store or 0x8B to load
+void ljit_slot(ljit_asm* a, int op, int reg, int slot) {
+	if (slot >= a->slots) { a->slots = slot + 1; }
+	ljit_byte(a, reg >= 8 ? 0x4C : 0x48);
+	ljit_byte(a, op);
+	ljit_byte(a, 0x85 | (reg & 7) << 3);
+	ljit_imm(a, -8 * (slot + 1), 4);
+}
+void ljit_store(ljit_asm* a, int slot, int reg) { ljit_slot(a, 0x89, reg, slot); }
+void ljit_load(ljit_asm* a, int reg, int slot) { ljit_slot(a, 0x8B, reg, slot); }
+
+// Emits a jump or call, returns where its offset is to be patched
+int ljit_jump(ljit_asm* a, const char* op, int n) {
+	ljit_bytes(a, op, n);
+	ljit_imm(a, 0, 4);
+	return a->len - 4;
+}
+void ljit_patch(ljit_asm* a, int at, int target) {
+	int offset = target - (at + 4);
+	memcpy(a->code + at, &offset, 4);
+}
+
+// Jumps to the exit giving up if the last test was not zero
+void ljit_give_up_if(ljit_asm* a, const char* op) {
+	a->exits = realloc(a->exits, sizeof(int) * (a->exit_count + 1));
+	a->exits[a->exit_count++] = ljit_jump(a, op, 2);
+}
+
+void ljit_return(ljit_asm* a) {
+	// xor edx, edx; leave; ret
+	ljit_bytes(a, "\x31\xD2\xC9\xC3", 4);
+}
+
+// Index of the formal bound to sym, the last if repeated, or -1
+int ljit_formal(ljit_asm* a, char* sym) {
+	lval* formals = a->func->formals;
+	for (int i = formals->count - 1; i >= 0; i--) {
+		if (formals->cell[i]->sym == sym) { return i; }
+	}
+	return -1;
+}
+
+// Value of a global that no lambda binds locally, or NULL
+lval* ljit_global(char* sym) {
+	if (lname_bound(sym)) { return NULL; }
+	lenv* global = lctx->env;
+	for (int i = 0; i < global->count; i++) {
+		if (global->syms[i] == sym) { return global->vals[i]; }
+	}
+	return NULL;
+}
+
+// Which form an expression headed by head is
+int ljit_form(ljit_asm* a, lval* head) {
+	if (head->type != LVAL_SYM || ljit_formal(a, head->sym) >= 0) {
+		return LJIT_NONE;
+	}
+	lval* v = ljit_global(head->sym);
+	if (!v || v->type != LVAL_FUNC) { return LJIT_NONE; }
+	if (v->builtin) {
+		for (int i = 0; i < (int)(sizeof(ljit_builtins) / sizeof(ljit_builtins[0])); i++) {
+			if (ljit_builtins[i].func == v->builtin) { return ljit_builtins[i].form; }
+		}
+		return LJIT_NONE;
+	}
+	// The global the lambda itself was defined as
+	lval* func = a->func;
+	if (v->body->cell == func->body->cell && v->body->count == func->body->count
+		&& v->formals->cell == func->formals->cell
+		&& v->formals->count == a->nargs && v->env->count == 0) {
+		return LJIT_SELF;
+	}
+	return LJIT_NONE;
+}
+
+void ljit_expr(ljit_asm* a, lval* v, int depth, bool tail);
+void ljit_sexpr(ljit_asm* a, lval** cells, int count, int depth, bool tail);
+
+void ljit_arith(ljit_asm* a, int form, lval** args, int n, int depth) {
+	ljit_expr(a, args[0], depth, false);
+	if (n == 1 && form == LJIT_SUB) {
+		// neg rax
+		ljit_bytes(a, "\x48\xF7\xD8", 3);
+	}
+	for (int i = 1; i < n; i++) {
+		ljit_store(a, depth, LJIT_RAX);
+		ljit_expr(a, args[i], depth + 1, false);
+		// mov rcx, rax
+		ljit_bytes(a, "\x48\x89\xC1", 3);
+		ljit_load(a, LJIT_RAX, depth);
+		switch (form) {
+			// add rax, rcx
+			case LJIT_ADD: ljit_bytes(a, "\x48\x01\xC8", 3); break;
+			// sub rax, rcx
+			case LJIT_SUB: ljit_bytes(a, "\x48\x29\xC8", 3); break;
+			// imul rax, rcx
+			case LJIT_MUL: ljit_bytes(a, "\x48\x0F\xAF\xC1", 4); break;
+			case LJIT_DIV:
+				// test rcx, rcx; jz exit; cqo; idiv rcx
+				ljit_bytes(a, "\x48\x85\xC9", 3);
+				ljit_give_up_if(a, "\x0F\x84");
+				ljit_bytes(a, "\x48\x99\x48\xF7\xF9", 5);
+				break;
+		}
+	}
+}
+
+void ljit_compare(ljit_asm* a, int form, lval** args, int depth) {
+	ljit_expr(a, args[0], depth, false);
+	ljit_store(a, depth, LJIT_RAX);
+	ljit_expr(a, args[1], depth + 1, false);
+	// mov rcx, rax
+	ljit_bytes(a, "\x48\x89\xC1", 3);
+	ljit_load(a, LJIT_RAX, depth);
+	if (form == LJIT_EQ || form == LJIT_NE) {
+		// cmp rax, rcx
+		ljit_bytes(a, "\x48\x39\xC8", 3);
+	} else {
+		// cmp eax, ecx, orderings compare as int like builtin_ordering
+		ljit_bytes(a, "\x39\xC8", 2);
+	}
+	// setcc al
+	ljit_byte(a, 0x0F);
+	switch (form) {
+		case LJIT_GT: ljit_byte(a, 0x9F); break;
+		case LJIT_LT: ljit_byte(a, 0x9C); break;
+		case LJIT_GE: ljit_byte(a, 0x9D); break;
+		case LJIT_LE: ljit_byte(a, 0x9E); break;
+		case LJIT_EQ: ljit_byte(a, 0x94); break;
+		case LJIT_NE: ljit_byte(a, 0x95); break;
+	}
+	ljit_byte(a, 0xC0);
+	// movzx eax, al
+	ljit_bytes(a, "\x0F\xB6\xC0", 3);
+}
+
+void ljit_if(ljit_asm* a, lval** args, int depth, bool tail) {
+	ljit_expr(a, args[0], depth, false);
+	// test rax, rax; jz else
+	ljit_bytes(a, "\x48\x85\xC0", 3);
+	int to_else = ljit_jump(a, "\x0F\x84", 2);
+	ljit_sexpr(a, args[1]->cell, args[1]->count, depth, tail);
+	// Branches in tail position return on their own
+	int to_end = tail ? -1 : ljit_jump(a, "\xE9", 1);
+	ljit_patch(a, to_else, a->len);
+	ljit_sexpr(a, args[2]->cell, args[2]->count, depth, tail);
+	if (!tail) { ljit_patch(a, to_end, a->len); }
+}
+
+void ljit_self(ljit_asm* a, lval** args, int depth, bool tail) {
+	for (int i = 0; i < a->nargs; i++) {
+		ljit_expr(a, args[i], depth + i, false);
+		ljit_store(a, depth + i, LJIT_RAX);
+	}
+	// A tail call rebinds the arguements and jumps back to the body
+	if (tail) {
+		for (int i = 0; i < a->nargs; i++) {
+			ljit_load(a, LJIT_RAX, depth + i);
+			ljit_store(a, i, LJIT_RAX);
+		}
+		ljit_patch(a, ljit_jump(a, "\xE9", 1), a->body);
+		return;
+	}
+	for (int i = 0; i < a->nargs; i++) {
+		ljit_load(a, ljit_arg_regs[i], depth + i);
+	}
+	ljit_patch(a, ljit_jump(a, "\xE8", 1), 0);
+	// Give up too if the callee did, test edx, edx
+	ljit_bytes(a, "\x85\xD2", 2);
+	ljit_give_up_if(a, "\x0F\x85");
+}
+
+/* Compiles an S-Expression of count cells into rax */
+void ljit_sexpr(ljit_asm* a, lval** cells, int count, int depth, bool tail) {
+	if (a->failed) { return; }
+	if (count == 0) {
+		a->failed = true;
+		return;
+	}
+	int form = ljit_form(a, cells[0]);
+	// A single value evaluates to itself
+	if (count == 1 && form == LJIT_NONE) {
+		ljit_expr(a, cells[0], depth, tail);
+		return;
+	}
+	lval** args = cells + 1;
+	int n = count - 1;
+	switch (form) {
+		case LJIT_ADD: case LJIT_SUB: case LJIT_MUL: case LJIT_DIV:
+			if (n < 1) { break; }
+			ljit_arith(a, form, args, n, depth);
+			if (tail) { ljit_return(a); }
+			return;
+		case LJIT_GT: case LJIT_LT: case LJIT_GE: case LJIT_LE:
+		case LJIT_EQ: case LJIT_NE:
+			if (n != 2) { break; }
+			ljit_compare(a, form, args, depth);
+			if (tail) { ljit_return(a); }
+			return;
+		case LJIT_IF:
+			if (n != 3 || args[1]->type != LVAL_QEXPR
+				|| args[2]->type != LVAL_QEXPR) { break; }
+			ljit_if(a, args, depth, tail);
+			return;
+		case LJIT_SELF:
+			if (n != a->nargs) { break; }
+			ljit_self(a, args, depth, tail);
+			return;
+	}
+	a->failed = true;
+}
+
+/* Compiles an expression into rax, returning from tail position */
+void ljit_expr(ljit_asm* a, lval* v, int depth, bool tail) {
+	if (a->failed) { return; }
+	if (v->type == LVAL_SEXPR) {
+		ljit_sexpr(a, v->cell, v->count, depth, tail);
+		return;
+	}
+	long num;
+	if (v->type == LVAL_NUM) {
+		num = v->num;
+	} else if (v->type == LVAL_SYM && ljit_formal(a, v->sym) >= 0) {
+		ljit_load(a, LJIT_RAX, ljit_formal(a, v->sym));
+		if (tail) { ljit_return(a); }
+		return;
+	} else if (v->type == LVAL_SYM && ljit_global(v->sym)
+		&& ljit_global(v->sym)->type == LVAL_NUM) {
+		num = ljit_global(v->sym)->num;
+	} else {
+		a->failed = true;
+		return;
+	}
+	// mov rax, num
+	ljit_bytes(a, "\x48\xB8", 2);
+	ljit_imm(a, num, 8);
+	if (tail) { ljit_return(a); }
+}
+
+void ljit_compile(ljit* jit, lval* func) {
+	ljit_asm a;
+	memset(&a, 0, sizeof(a));
+	a.func = func;
+	a.nargs = func->formals->count;
+
+	jit->state = LJIT_FAILED;
+	if (a.nargs > LJIT_ARGS) { return; }
+	for (int i = 0; i < a.nargs; i++) {
+		if (func->formals->cell[i]->sym == lname_rest) { return; }
+	}
+	// Compile whichever body the interpreter would evaluate
+	lval* body = lfold_current(func) ? func->folded : func->body;
+
+	// push rbp; mov rbp, rsp; sub rsp, frame
+	ljit_bytes(&a, "\x55\x48\x89\xE5\x48\x81\xEC", 7);
+	int frame = a.len;
+	ljit_imm(&a, 0, 4);
+	for (int i = 0; i < a.nargs; i++) {
+		ljit_store(&a, i, ljit_arg_regs[i]);
+	}
+	a.body = a.len;
+	ljit_sexpr(&a, body->cell, body->count, a.nargs, true);
+
+	// Exit giving up, mov edx, 1; leave; ret
+	for (int i = 0; i < a.exit_count; i++) {
+		ljit_patch(&a, a.exits[i], a.len);
+	}
+	ljit_bytes(&a, "\xBA\x01\x00\x00\x00\xC9\xC3", 7);
+
+	if (!a.failed) {
+		// Keep rsp 16 byte aligned
+		int size = (a.slots * 8 + 15) & ~15;
+		memcpy(a.code + frame, &size, 4);
+
+		long page = sysconf(_SC_PAGESIZE);
+		size_t mapped = (a.len + page - 1) / page * page;
+		void* code = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code != MAP_FAILED) {
+			memcpy(code, a.code, a.len);
+			// Never writable and executable at once
+			if (mprotect(code, mapped, PROT_READ | PROT_EXEC) == 0) {
+				jit->code = code;
+				jit->size = mapped;
+				jit->nargs = a.nargs;
+				jit->state = LJIT_READY;
+			} else {
+				munmap(code, mapped);
+			}
+		}
+	}
+	free(a.code);
+	free(a.exits);
+}
+
+/* Runs func's code if it is compiled, NULL to interpret the call instead */
+lval* ljit_call(lval* func, lval* arg) {
+	// Limits and profiles are only checked by the interpreter
+	if (!ljit_enabled || !lctx || lctx->limited || lprof_on) { return NULL; }
+	// Only whole calls, not partial applications
+	if (func->env->count != 0 || arg->count != func->formals->count) {
+		return NULL;
+	}
+
+	ljit* jit = func->jit;
+	long version = lcache_version_now();
+	if (jit->version != version || jit->env != lctx->env) {
+		ljit_reset(jit);
+		jit->version = version;
+		jit->env = lctx->env;
+	}
+	if (jit->state == LJIT_COLD && ++jit->calls >= LJIT_THRESHOLD) {
+		ljit_compile(jit, func);
+	}
+	if (jit->state != LJIT_READY || arg->count != jit->nargs) { return NULL; }
+
+	// Guard the arguements are numbers
+	long args[LJIT_ARGS] = { 0 };
+	for (int i = 0; i < arg->count; i++) {
+		if (arg->cell[i]->type != LVAL_NUM) { return NULL; }
+		args[i] = arg->cell[i]->num;
+	}
+	LSTAT(jit_calls);
+	ljit_result result = ((ljit_code)jit->code)(
+		args[0], args[1], args[2], args[3], args[4], args[5]);
+	if (result.deopt) {
+		LSTAT(jit_deopts);
+		if (++jit->deopts >= LJIT_DEOPTS) {
+			ljit_reset(jit);
+			jit->state = LJIT_FAILED;
+		}
+		return NULL;
+	}
+	lval_del(arg);
+	return lval_num(result.value);
+}
+
+int lispa_jit(int on) {
+	ljit_enabled = on;
+	return 1;
+}
+
+#else
+
+ljit* ljit_new(void) {
+	return NULL;
+}
+
+void ljit_release(ljit* jit) {
+}
+
+lval* ljit_call(lval* func, lval* arg) {
+	return NULL;
+}
 
-	lval* result;
-	// Set to s-expressions for evaluation
-	arg->cell[1]->type = LVAL_SEXPR;
-	arg->cell[2]->type = LVAL_SEXPR;
+int lispa_jit(int on) {
+	return 0;
+}
 
-	// If condition is true
-	if (arg->cell[0]->num) {
-		// Evaluate first expression
-		result = lval_eval(env, lval_pop(arg, 1));
+#endif
+
+// TIMING
+
+// Clocks and counters at a point in time
+typedef struct lmark {
+	double wall;
+	double cpu;
+	long allocs;
+#ifdef LISPA_STATS
+	long copies;
+#endif
+} lmark;
+
+lmark lmark_now(void) {
+	lmark mark;
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	mark.cpu = t.tv_sec + t.tv_nsec / 1e9;
+	mark.wall = lctx_now();
+	mark.allocs = lctx ? lctx->allocs : 0;
+#ifdef LISPA_STATS
+	mark.copies = lstats_thread.copies;
+#endif
+	return mark;
+}
+
+// Writes seconds in the unit that suits it best
+void lout_time(lout* out, double seconds) {
+	char buffer[32];
+	if (seconds < 1e-6) {
+		snprintf(buffer, sizeof(buffer), "%.0f ns", seconds * 1e9);
+	} else if (seconds < 1e-3) {
+		snprintf(buffer, sizeof(buffer), "%.2f us", seconds * 1e6);
+	} else if (seconds < 1) {
+		snprintf(buffer, sizeof(buffer), "%.2f ms", seconds * 1e3);
 	} else {
-		// Or evaluate second expression
-		result = lval_eval(env, lval_pop(arg, 2));
+		snprintf(buffer, sizeof(buffer), "%.3f s", seconds);
 	}
+	lout_puts(out, buffer);
+}
+
+// Evaluates a copy of a Q-Expression
+lval* lval_eval_qexpr(lenv* env, lval* expression) {
+	lval* x = lval_copy(expression);
+	x->type = LVAL_SEXPR;
+	return lval_eval(env, x);
+}
+
+/*
+Evaluates a Q-Expression and prints how long it took, on the wall clock
+and on the thread's CPU clock, and how many values it allocated
+*/
+lval* builtin_time(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "time");
+	LASSERT_TYPE(arg, 0, LVAL_QEXPR, "time");
+
+	lmark start = lmark_now();
+	lval* result = lval_eval_qexpr(env, arg->cell[0]);
+	lmark end = lmark_now();
 	lval_del(arg);
+
+	lout* out = lctx_out();
+	lout_puts(out, "time: ");
+	lout_time(out, end.wall - start.wall);
+	lout_puts(out, " wall, ");
+	lout_time(out, end.cpu - start.cpu);
+	lout_puts(out, " cpu, ");
+	lout_num(out, end.allocs - start.allocs);
+	lout_puts(out, " allocs");
+#ifdef LISPA_STATS
+	lout_puts(out, ", ");
+	lout_num(out, end.copies - start.copies);
+	lout_puts(out, " copies");
+#endif
+	lout_putc(out, '\n');
+	lout_end(out);
 	return result;
 }
 
-// Loads a lispa file
-lval* builtin_load(lenv* env, lval* arg) {
-	// Ensure that there is one arguement that is a string
-	LASSERT_ARGS(arg, 1, "load");
-	LASSERT_TYPE(arg, 0, LVAL_STR, "load");
+int ltime_compare(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
 
-	mpc_result_t result;
-	// Parse file by string name
-	if (mpc_parse_contents(arg->cell[0]->str, Lispy, &result)) {
-		// Read contents
-		lval* expression = lval_read(result.output);
-		//char* result.error->filename;
-		mpc_ast_delete(result.output);
-		
-		// Evaluate each expression
-		while (expression->count > 0) {
-			lval* result = lval_eval(env, lval_pop(expression, 0));
-			// If there is an error, print it
-			if (result->type == LVAL_ERR) {
-				lval_println(result);
-				
-			}
-			lval_del(result);
+// Percentile p of sorted times
+double ltime_percentile(double* times, int n, int p) {
+	int i = (int)((long)(n - 1) * p / 100);
+	return times[i];
+}
+
+/*
+Evaluates a Q-Expression n times, after a tenth as many warmup runs,
+prints the median and percentiles of the wall time of a run and
+returns them in nanoseconds in a map
+*/
+lval* builtin_bench(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 2, "bench");
+	LASSERT_TYPE(arg, 0, LVAL_NUM, "bench");
+	LASSERT_TYPE(arg, 1, LVAL_QEXPR, "bench");
+	long n = arg->cell[0]->num;
+	LASSERT(arg, n > 0, "'bench' needs at least 1 run. Got %li", n);
+	lval* expression = arg->cell[1];
+
+	// Warmup fills the free lists and caches
+	long warmup = n / 10 > 0 ? n / 10 : 1;
+	for (long i = 0; i < warmup; i++) {
+		lval* result = lval_eval_qexpr(env, expression);
+		if (result->type == LVAL_ERR) {
+			lval_del(arg);
+			return result;
 		}
-		
-		// Delete arguements and expressions
-		lval_del(expression);
-		lval_del(arg);
+		lval_del(result);
+	}
 
-		// Return empty list
-		return lval_sexpr();
-	} 
-	// If unable to parse file
-	else {
-		// Get parser error
-		char* error_message = mpc_err_string(result.error);
-		mpc_err_delete(result.error);
+	/*
+	Runs are timed back to back with freeing their results included, from
+	before the CPU clock starts to after it stops, so the CPU time of the
+	runs can't add up to more than their wall time.
+	*/
+	double* times = malloc(sizeof(double) * n);
+	double last = lctx_now();
+	lmark start = lmark_now();
+	lmark end = start;
+	for (long i = 0; i < n; i++) {
+		lval* result = lval_eval_qexpr(env, expression);
+		if (result->type == LVAL_ERR) {
+			free(times);
+			lval_del(arg);
+			return result;
+		}
+		lval_del(result);
+		double now;
+		if (i == n - 1) {
+			end = lmark_now();
+			now = end.wall;
+		} else {
+			now = lctx_now();
+		}
+		times[i] = now - last;
+		last = now;
+	}
+	lval_del(arg);
+	qsort(times, n, sizeof(double), ltime_compare);
 
-		// Create error lval message from parser error
-		lval* error = lval_err("Could not load library %s", error_message);
+	static const char* names[] = { "min", "median", "p90", "p99", "max" };
+	double values[] = {
+		times[0], ltime_percentile(times, n, 50), ltime_percentile(times, n, 90),
+		ltime_percentile(times, n, 99), times[n - 1]
+	};
+	free(times);
 
-		// Delete error message and arguements
-		free(error_message);
-		lval_del(arg);
+	lout* out = lctx_out();
+	lout_puts(out, "bench: ");
+	lout_num(out, n);
+	lout_puts(out, " runs");
+	lval* stats = lval_map();
+	lmap_put(stats->map, lval_str("runs"), lval_num(n));
+	for (int i = 0; i < 5; i++) {
+		lout_puts(out, ", ");
+		lout_puts(out, names[i]);
+		lout_putc(out, ' ');
+		lout_time(out, values[i]);
+		lmap_put(stats->map, lval_str((char*)names[i]), lval_num(values[i] * 1e9));
+	}
+	long allocs = (end.allocs - start.allocs) / n;
+	lout_puts(out, ", ");
+	lout_num(out, allocs);
+	lout_puts(out, " allocs/run, ");
+	lout_time(out, (end.cpu - start.cpu) / n);
+	lout_puts(out, " cpu/run\n");
+	lout_end(out);
+	lmap_put(stats->map, lval_str("allocs"), lval_num(allocs));
+	return stats;
+}
 
-		return error;
+// STATS BUILTIN
+
+#ifdef LISPA_STATS
+
+// Counters that are not by type
+static const struct {
+	const char* name;
+	size_t offset;
+} lstats_fields[] = {
+	{ "reused", offsetof(lstats, reused) },
+	{ "copies", offsetof(lstats, copies) },
+	{ "copy-bytes", offsetof(lstats, copy_bytes) },
+	{ "cells-copies", offsetof(lstats, cells_copies) },
+	{ "env-copies", offsetof(lstats, env_copies) },
+	{ "env-lookups", offsetof(lstats, env_lookups) },
+	{ "env-walked", offsetof(lstats, env_walked) },
+	{ "env-compares", offsetof(lstats, env_compares) },
+	{ "reallocs", offsetof(lstats, reallocs) },
+	{ "cache-hits", offsetof(lstats, cache_hits) },
+	{ "cache-misses", offsetof(lstats, cache_misses) },
+	{ "jit-calls", offsetof(lstats, jit_calls) },
+	{ "jit-deopts", offsetof(lstats, jit_deopts) },
+};
+
+#define LSTATS_FIELD(i) (*(long*)((char*)&lstats_thread + lstats_fields[i].offset))
+#define LSTATS_FIELDS_COUNT (int)(sizeof(lstats_fields) / sizeof(lstats_fields[0]))
+
+// Map of type names to counts
+lval* lstats_by_type(long* counts) {
+	lval* map = lval_map();
+	for (int t = 0; t < LVAL_TYPES; t++) {
+		lmap_put(map->map, lval_str(ltype_name(t)), lval_num(counts[t]));
 	}
+	return map;
 }
 
-lval* builtin_print(lenv* env, lval* arg) {
-	// Print each arguement with a space
-	for (int i = 0; i < arg->count; i++) {
-		lval_print(arg->cell[i]);
-		putchar(' ');
+// If the counter is named in the Q-Expression, or it names none
+bool lstats_wanted(lval* names, const char* name) {
+	if (names->count == 0) { return true; }
+	for (int i = 0; i < names->count; i++) {
+		if (strcmp(names->cell[i]->sym, name) == 0) { return true; }
+	}
+	return false;
+}
+
+/*
+Counters of the calling thread named in a Q-Expression, all of them for
+{}, as a map with maps of the allocations and frees by type
+*/
+lval* builtin_stats(lenv* env, lval* arg) {
+	LASSERT_ARGS(arg, 1, "stats");
+	LASSERT_TYPE(arg, 0, LVAL_QEXPR, "stats");
+	lval* names = arg->cell[0];
+	for (int i = 0; i < names->count; i++) {
+		LASSERT(arg, names->cell[i]->type == LVAL_SYM,
+			"'stats' can only take symbols. Got %s, Expected %s",
+			ltype_name(names->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+	// Counted before the map adds its own allocations
+	lstats counts = lstats_thread;
+
+	lval* map = lval_map();
+	if (lstats_wanted(names, "allocs")) {
+		lmap_put(map->map, lval_str("allocs"), lstats_by_type(counts.allocs));
+	}
+	if (lstats_wanted(names, "frees")) {
+		lmap_put(map->map, lval_str("frees"), lstats_by_type(counts.frees));
+	}
+	for (int i = 0; i < LSTATS_FIELDS_COUNT; i++) {
+		if (!lstats_wanted(names, lstats_fields[i].name)) { continue; }
+		long value = *(long*)((char*)&counts + lstats_fields[i].offset);
+		lmap_put(map->map, lval_str((char*)lstats_fields[i].name), lval_num(value));
 	}
-	// Newline and delete arguements
-	putchar('\n');
 	lval_del(arg);
+	return map;
+}
 
-	return lval_sexpr();
+int lispa_stats_print(FILE* file) {
+	long allocs = 0;
+	long frees = 0;
+	fprintf(file, "%-16s %14s %14s\n", "type", "allocs", "frees");
+	for (int t = 0; t < LVAL_TYPES; t++) {
+		fprintf(file, "%-16s %14li %14li\n", ltype_name(t),
+			lstats_thread.allocs[t], lstats_thread.frees[t]);
+		allocs += lstats_thread.allocs[t];
+		frees += lstats_thread.frees[t];
+	}
+	fprintf(file, "%-16s %14li %14li\n\n", "total", allocs, frees);
+	for (int i = 0; i < LSTATS_FIELDS_COUNT; i++) {
+		fprintf(file, "%-16s %14li\n", lstats_fields[i].name, LSTATS_FIELD(i));
+	}
+	long lookups = lstats_thread.cache_hits + lstats_thread.cache_misses;
+	if (lookups) {
+		fprintf(file, "%-16s %13.1f%%\n", "cache-hit-rate",
+			100.0 * lstats_thread.cache_hits / lookups);
+	}
+	return 1;
 }
 
-lval* builtin_error(lenv* env, lval* arg) {
-	// Check that there is only one string arguement
-	LASSERT_ARGS(arg, 1, "error");
-	LASSERT_TYPE(arg, 0, LVAL_STR, "error");
+#else
 
-	// Create error from first arguement
-	lval* error = lval_err(arg->cell[0]->str);
+lval* builtin_stats(lenv* env, lval* arg) {
 	lval_del(arg);
+	return lval_err("'stats' needs lispa built with -DLISPA_STATS");
+}
 
-	return error;
+int lispa_stats_print(FILE* file) {
+	return 0;
 }
+
+#endif
+
 void lenv_builtin_add(lenv* env, char* builtin_func_name, lbuiltin func) {
 	lval* k = lval_sym(builtin_func_name);
 	lval* f = lval_func(func);
@@ -1053,12 +7222,33 @@ void lenv_builtin_add(lenv* env, char* builtin_func_name, lbuiltin func) {
 	lval_del(f);
 }
 
+// Adds a builtin that expands its unevaluated arguements, see MACROS
+void lenv_macro_add(lenv* env, char* name, lbuiltin func) {
+	lval* k = lval_sym(name);
+	lval* f = lval_func(func);
+	f->macro = true;
+	lenv_put(env, k, f);
+	lval_del(k);
+	lval_del(f);
+}
+
+// Adds a builtin that evaluates its own arguements, see SPECIAL FORMS
+void lenv_special_add(lenv* env, char* name, lbuiltin func) {
+	lval* k = lval_sym(name);
+	lval* f = lval_func(func);
+	f->special = true;
+	lenv_put(env, k, f);
+	lval_del(k);
+	lval_del(f);
+}
+
 // Register builtin functions
 void lenv_add_builtins(lenv* env) {
 	// variable functions
 	lenv_builtin_add(env, "def", builtin_def);
 	lenv_builtin_add(env, "\\", builtin_lambda);
 	lenv_builtin_add(env, "put", builtin_put);
+	lenv_builtin_add(env, "defmacro", builtin_defmacro);
 
 	// list functions
 	lenv_builtin_add(env, "list", builtin_list);
@@ -1066,6 +7256,59 @@ void lenv_add_builtins(lenv* env) {
 	lenv_builtin_add(env, "tail", builtin_tail);
 	lenv_builtin_add(env, "eval", builtin_eval);
 	lenv_builtin_add(env, "join", builtin_join);
+	lenv_builtin_add(env, "take", builtin_take);
+	lenv_builtin_add(env, "drop", builtin_drop);
+	lenv_builtin_add(env, "pmap", builtin_pmap);
+	lenv_builtin_add(env, "pfilter", builtin_pfilter);
+	lenv_builtin_add(env, "preduce", builtin_preduce);
+
+	// vector functions
+	lenv_builtin_add(env, "vec", builtin_vec);
+	lenv_builtin_add(env, "vec-ref", builtin_vec_ref);
+	lenv_builtin_add(env, "vec-set!", builtin_vec_set);
+	lenv_builtin_add(env, "vec-len", builtin_vec_len);
+	lenv_builtin_add(env, "vec-push", builtin_vec_push);
+	lenv_builtin_add(env, "vec-slice", builtin_vec_slice);
+
+	// hash map functions
+	lenv_builtin_add(env, "hmap", builtin_hmap);
+	lenv_builtin_add(env, "hget", builtin_hget);
+	lenv_builtin_add(env, "hput", builtin_hput);
+	lenv_builtin_add(env, "hdel", builtin_hdel);
+	lenv_builtin_add(env, "hhas", builtin_hhas);
+	lenv_builtin_add(env, "hlen", builtin_hlen);
+	lenv_builtin_add(env, "hkeys", builtin_hkeys);
+	lenv_builtin_add(env, "hvals", builtin_hvals);
+	lenv_builtin_add(env, "hitems", builtin_hitems);
+
+	// lazy sequence functions
+	lenv_builtin_add(env, "range", builtin_range);
+	lenv_builtin_add(env, "iterate", builtin_iterate);
+	lenv_builtin_add(env, "lazy-map", builtin_lazy_map);
+	lenv_builtin_add(env, "lazy-filter", builtin_lazy_filter);
+	lenv_builtin_add(env, "seq-fold", builtin_seq_fold);
+
+	// transducer functions
+	lenv_builtin_add(env, "xmap", builtin_xmap);
+	lenv_builtin_add(env, "xfilter", builtin_xfilter);
+	lenv_builtin_add(env, "xtake", builtin_xtake);
+	lenv_builtin_add(env, "comp", builtin_comp);
+	lenv_builtin_add(env, "transduce", builtin_transduce);
+	lenv_builtin_add(env, "into", builtin_into);
+
+	// file functions
+	lenv_builtin_add(env, "open", builtin_open);
+	lenv_builtin_add(env, "read-line", builtin_read_line);
+	lenv_builtin_add(env, "lines", builtin_lines);
+	lenv_builtin_add(env, "close", builtin_close);
+
+	// data format functions
+	lenv_builtin_add(env, "json-parse", builtin_json_parse);
+	lenv_builtin_add(env, "json-emit", builtin_json_emit);
+	lenv_builtin_add(env, "csv-read", builtin_csv_read);
+	lenv_builtin_add(env, "csv-write", builtin_csv_write);
+	lenv_builtin_add(env, "serialize", builtin_serialize);
+	lenv_builtin_add(env, "deserialize", builtin_deserialize);
 	
 	// math functions
 	lenv_builtin_add(env, "+", builtin_add);
@@ -1075,6 +7318,11 @@ void lenv_add_builtins(lenv* env) {
 
 	// comparison functions
 	lenv_builtin_add(env, "if", builtin_if);
+	lenv_macro_add(env, "case", builtin_case);
+	lenv_special_add(env, "do", builtin_do);
+	lenv_special_add(env, "let", builtin_let);
+	lenv_special_add(env, "and", builtin_and);
+	lenv_special_add(env, "or", builtin_or);
 	lenv_builtin_add(env, "==", builtin_equal);
 	lenv_builtin_add(env, "!=", builtin_not_equal);
 
@@ -1087,121 +7335,154 @@ void lenv_add_builtins(lenv* env) {
 	lenv_builtin_add(env, "load", builtin_load);
 	lenv_builtin_add(env, "print", builtin_print);
 	lenv_builtin_add(env, "error", builtin_error);
+	lenv_builtin_add(env, "str-cat", builtin_str_cat);
+	lenv_builtin_add(env, "str-len", builtin_str_len);
+	lenv_builtin_add(env, "substr", builtin_substr);
+	lenv_builtin_add(env, "str-find", builtin_str_find);
+	lenv_builtin_add(env, "str-split", builtin_str_split);
+	lenv_builtin_add(env, "str-join", builtin_str_join);
+	lenv_builtin_add(env, "num->str", builtin_num_to_str);
+	lenv_builtin_add(env, "str->num", builtin_str_to_num);
+	lenv_builtin_add(env, "sbuf", builtin_sbuf);
+	lenv_builtin_add(env, "sbuf-add", builtin_sbuf_add);
+	lenv_builtin_add(env, "sbuf-str", builtin_sbuf_str);
+
+	// instrumentation functions
+	lenv_builtin_add(env, "stats", builtin_stats);
+	lenv_builtin_add(env, "time", builtin_time);
+	lenv_builtin_add(env, "bench", builtin_bench);
 }
 
-void lval_expr_print(lval* val, char open, char close) {
-	putchar(open);
+void lval_expr_print(lout* out, lval* val, char open, char close) {
+	lout_putc(out, open);
 	for (int i = 0; i < val->count; i++) {
 		// Print value inside
-		lval_print(val->cell[i]);
+		lval_print(out, val->cell[i]);
 		// Put whitespace for all except for last element
 		if (i != (val->count-1)) {
-			putchar(' ');
+			lout_putc(out, ' ');
 		}
 	}
-	putchar(close);
+	lout_putc(out, close);
 }
 
-void lval_print_str(lval* v) {
-	// Make a copy of the string
-	char* copy = malloc(strlen(v->str) + 1);
-	strcpy(copy, v->str);
-	// Escape the string
-	copy = mpcf_escape(copy);
-	// Print it between " "
-	printf("\"%s\"", copy);
-	free(copy);
+void lval_vec_print(lout* out, lval* v) {
+	int count = lval_vec_len(v);
+	lval** items = lval_vec_items(v);
+	lout_putc(out, '[');
+	for (int i = 0; i < count; i++) {
+		lval_print(out, items[i]);
+		if (i != (count-1)) {
+			lout_putc(out, ' ');
+		}
+	}
+	lout_putc(out, ']');
+}
+
+void lval_map_print(lout* out, lval* v) {
+	bool first = true;
+	lout_puts(out, "#{");
+	for (int t = 0; t < 2; t++) {
+		lmap_table* table = &v->map->tables[t];
+		for (unsigned long i = 0; i < table->size; i++) {
+			for (lmap_entry* e = table->buckets[i]; e; e = e->next) {
+				if (!first) { lout_putc(out, ' '); }
+				first = false;
+				lval_print(out, e->key);
+				lout_putc(out, ' ');
+				lval_print(out, e->val);
+			}
+		}
+	}
+	lout_putc(out, '}');
+}
+
+// Escape sequences of the characters mpcf_unescape reads back
+static const char* lstr_escapes[256] = {
+	['\a'] = "\\a", ['\b'] = "\\b", ['\f'] = "\\f", ['\n'] = "\\n",
+	['\r'] = "\\r", ['\t'] = "\\t", ['\v'] = "\\v", ['\\'] = "\\\\",
+	['\''] = "\\'", ['\"'] = "\\\"", ['\0'] = "\\0"
+};
+
+void lval_print_str(lout* out, lval* v) {
+	char* str = v->type == LVAL_STR ? v->str : v->sbuf->data;
+	int len = v->type == LVAL_STR ? v->str_len : v->sbuf->len;
+
+	// Print it between " ", escaping as we go
+	lout_putc(out, '"');
+	int run = 0;
+	for (int i = 0; i < len; i++) {
+		const char* escape = lstr_escapes[(unsigned char)str[i]];
+		if (escape) {
+			// Write the unescaped run before the escape in one go
+			lout_write(out, str + run, i - run);
+			lout_puts(out, escape);
+			run = i + 1;
+		}
+	}
+	lout_write(out, str + run, len - run);
+	lout_putc(out, '"');
 }
 // prints value or error of lisp value
-void lval_print(lval* var) {
+void lval_print(lout* out, lval* var) {
 	switch (var->type) {
 		case LVAL_FUNC: 
 			if (var->builtin) {
-				printf("<builtin>");
+				lout_puts(out, "<builtin>");
 			} else {
-				printf("(\\ ");
-				lval_print(var->formals);
-				putchar(' ');
-				lval_print(var->body);
-				putchar(')');
+				lout_puts(out, var->macro ? "(macro " : "(\\ ");
+				lval_print(out, var->formals);
+				lout_putc(out, ' ');
+				lval_print(out, var->body);
+				lout_putc(out, ')');
 			}
 		 	break;
-		case LVAL_NUM: printf("%li", var->num); break;
-		case LVAL_ERR: printf(RED "Error: " RESET "%s" , var->err); break;
-		case LVAL_SYM: printf("%s", var->sym); break;
-		case LVAL_STR: lval_print_str(var); break;
+		case LVAL_NUM: lout_num(out, var->num); break;
+		case LVAL_ERR:
+			lout_puts(out, RED "Error: " RESET);
+			lout_puts(out, var->err);
+			break;
+		case LVAL_SYM: lout_puts(out, var->sym); break;
+		case LVAL_STR: lval_print_str(out, var); break;
 
-		case LVAL_SEXPR: lval_expr_print(var, '(', ')'); break;
-		case LVAL_QEXPR: lval_expr_print(var, '{', '}'); break;
+		case LVAL_SEXPR: lval_expr_print(out, var, '(', ')'); break;
+		case LVAL_QEXPR: lval_expr_print(out, var, '{', '}'); break;
+		case LVAL_VEC: lval_vec_print(out, var); break;
+		case LVAL_MAP: lval_map_print(out, var); break;
+		case LVAL_SBUF:
+			lout_puts(out, "<sbuf ");
+			lval_print_str(out, var);
+			lout_putc(out, '>');
+			break;
+		case LVAL_SEQ: lout_puts(out, "<seq>"); break;
+		case LVAL_XFORM: lout_puts(out, "<transducer>"); break;
+		case LVAL_FILE: lout_puts(out, var->file->file ? "<file>" : "<closed file>"); break;
 	}
 }
-// print lisp value with newline
-void lval_println(lval* v) {
-	lval_print(v);
-	putchar('\n');
-}
-// Interactive prompt
-void prompt(lenv* env) {
-	puts("Lispa Version 0.0.1");
-	puts("Press Ctrl+c to Exit\n");
-	// Infinite loop until Ctrl+c
-	while (1) {
-		// Get user input
-		char* input = readline("lispa> ");
-		// Add command history
-		add_history(input);
-		
-		// Try to parse user input
-		mpc_result_t result;
-		
-		// If parsing sucessful
-		if (mpc_parse("<stdin>", input, Lispy, &result)) {
-			lval* x = lval_eval(env, lval_read(result.output));
-			lval_println(x);
-			lval_del(x);
-			
-			mpc_ast_delete(result.output);
-		} else {
-			// Else, print error
-			mpc_err_print(result.error);
-			mpc_err_delete(result.error);
-		}
-		free(input);
-	}
+// print lisp value with newline and flush it
+void lval_println(lout* out, lval* v) {
+	lval_print(out, v);
+	lout_putc(out, '\n');
+	lout_end(out);
 }
-// Loads a lispa file from a filename
-lval* load_file(lenv* env, char* filename) {
-	// Create a list of arguements with the filename as arguement
-	lval* args = lval_add(lval_sexpr(), lval_str(filename));
 
-	// Load the files
-	lval* result = builtin_load(env, args);
-	
-	// If there is an error, print it
-	if (result->type == LVAL_ERR) {
-		printf("Unable to load file %s\n", filename);
-		lval_println(result);
-		lval_del(result);
-	}
-	return result;
-}
-// Loads multiple a lispa files from a list of filenames
-void load_files(lenv* env, int argc, char** argv) {
-	// Loop over each file name in argv
-	for (int i = 1; i < argc; i++) {
-		load_file(env, argv[i]);
-	}
-}
+// EMBEDDING
 
-int main(int argc, char** argv) {
-	Number = mpc_new("number");
-	Symbol = mpc_new("symbol");
-	String = mpc_new("string");
-	Comment = mpc_new("comment");
-	Sexpr = mpc_new("sexpr");
-	Qexpr = mpc_new("qexpr");
-	Expr = mpc_new("expr");
-	Lispy = mpc_new("lispy");
+lispa_ctx* lispa_ctx_new(const char* stdlib) {
+	lispa_ctx* ctx = calloc(1, sizeof(lispa_ctx));
+	ctx->out.file = stdout;
+	ctx->cache_version = lctx_version();
+	ctx->fold_epoch = lctx_version();
+	lispa_ctx* previous = lctx_use(ctx);
+
+	ctx->Number = mpc_new("number");
+	ctx->Symbol = mpc_new("symbol");
+	ctx->String = mpc_new("string");
+	ctx->Comment = mpc_new("comment");
+	ctx->Sexpr = mpc_new("sexpr");
+	ctx->Qexpr = mpc_new("qexpr");
+	ctx->Expr = mpc_new("expr");
+	ctx->Lispy = mpc_new("lispy");
 
 	const char* language = "  \
 		number   : /-?[0-9]+/;                       \
@@ -1214,35 +7495,213 @@ int main(int argc, char** argv) {
 		| <qexpr> | <string> | <comment>; \
 		lispy    : /^/ <expr>+ /$/ ;             \
 		";
-	
-	char* standard_lib = "stlib.lspy";
 
 	// Define the language
 	mpca_lang(MPCA_LANG_DEFAULT, language,
-	  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-	  
-	lenv* env = lenv_new();
+	  ctx->Number, ctx->Symbol, ctx->String, ctx->Comment,
+	  ctx->Sexpr, ctx->Qexpr, ctx->Expr, ctx->Lispy);
+
+	ctx->env = lenv_new();
 	// Add builtin functions to environment
-	lenv_add_builtins(env);
+	lenv_add_builtins(ctx->env);
 
 	// Load the standard library
-	load_file(env, standard_lib);
-
-	// If there is 1 or more files
-	if (argc >= 2) {
-		load_files(env, argc, argv);
-	} 
-	// If there no files, show interactive prompt
-	else if (argc == 1) {
-		prompt(env);
+	if (stdlib) {
+		lval* result = builtin_load(ctx->env,
+			lval_add(lval_sexpr(), lval_str((char*)stdlib)));
+		if (result->type == LVAL_ERR) {
+			printf("Unable to load file %s\n", stdlib);
+			lval_println(&ctx->out, result);
+		}
+		lval_del(result);
 	}
-	
+	lctx_use(previous);
+	return ctx;
+}
+
+void lispa_ctx_del(lispa_ctx* ctx) {
+	lispa_ctx* previous = lctx_use(ctx);
+
 	// Delete environment
-	lenv_del(env);
-	
-	// Undefine and delete parsers 
-	mpc_cleanup(8, Number, Symbol, String, 
-		Comment, Sexpr, Qexpr, Expr, Lispy);
-	
-	return 0;
-}
\ No newline at end of file
+	lenv_del(ctx->env);
+	lout_flush(&ctx->out);
+
+	// Undefine and delete parsers, unless they are shared
+	if (!ctx->origin) {
+		mpc_cleanup(8, ctx->Number, ctx->Symbol, ctx->String,
+			ctx->Comment, ctx->Sexpr, ctx->Qexpr, ctx->Expr, ctx->Lispy);
+	}
+
+	// Free the lvals kept for reuse
+	lctx_use(NULL);
+	while (ctx->free_list) {
+		lval* next = *(lval**)ctx->free_list;
+		free(ctx->free_list);
+		ctx->free_list = next;
+	}
+	free(ctx);
+	lctx_use(previous == ctx ? NULL : previous);
+}
+
+lispa_ctx* lispa_ctx_clone(lispa_ctx* ctx) {
+	lispa_ctx* clone = calloc(1, sizeof(lispa_ctx));
+	clone->out.file = stdout;
+	clone->limited = ctx->limited;
+	clone->timeout_ms = ctx->timeout_ms;
+	clone->max_memory = ctx->max_memory;
+
+	lctx_share_parsers(clone, ctx);
+	// Cloned lambdas keep their folded bodies
+	clone->fold_epoch = ctx->fold_epoch;
+	clone->fold_shadows = ctx->fold_shadows;
+
+	lispa_ctx* previous = lctx_use(clone);
+	clone->env = lenv_clone(ctx->env);
+	lcache_invalidate();
+	lctx_use(previous);
+	return clone;
+}
+
+long lispa_ctx_version(lispa_ctx* ctx) {
+	return ctx->env->version;
+}
+
+void lispa_ctx_set_limits(lispa_ctx* ctx, long timeout_ms, long memory) {
+	ctx->timeout_ms = timeout_ms;
+	ctx->max_memory = memory;
+	ctx->limited = timeout_ms || memory;
+}
+
+void lispa_ctx_set_output(lispa_ctx* ctx, FILE* file) {
+	lout_flush(&ctx->out);
+	ctx->out.file = file;
+}
+
+void lispa_ctx_hold_output(lispa_ctx* ctx, int hold) {
+	ctx->out.hold = hold;
+	if (!hold) { lout_flush(&ctx->out); }
+}
+
+void lispa_ctx_flush(lispa_ctx* ctx) {
+	lout_flush(&ctx->out);
+}
+
+void lispa_register(lispa_ctx* ctx, const char* name, lispa_builtin func) {
+	lispa_ctx* previous = lctx_use(ctx);
+	lenv_builtin_add(ctx->env, (char*)name, func);
+	lctx_use(previous);
+}
+
+lispa_val* lispa_parse(lispa_ctx* ctx, const char* source) {
+	lispa_ctx* previous = lctx_use(ctx);
+	lval* x;
+	mpc_result_t result;
+	if (mpc_parse("<string>", source, ctx->Lispy, &result)) {
+		x = lval_read(result.output);
+		mpc_ast_delete(result.output);
+	} else {
+		char* error_message = mpc_err_string(result.error);
+		x = lval_err("%s", error_message);
+		free(error_message);
+		mpc_err_delete(result.error);
+	}
+	lctx_use(previous);
+	return x;
+}
+
+lispa_val* lispa_eval(lispa_ctx* ctx, lispa_val* form) {
+	lispa_ctx* previous = lctx_enter(ctx);
+	lval* x = lval_eval(ctx->env, lval_copy(form));
+	lctx_use(previous);
+	return x;
+}
+
+lispa_val* lispa_eval_string(lispa_ctx* ctx, const char* source) {
+	lval* expression = lispa_parse(ctx, source);
+	if (expression->type == LVAL_ERR) { return expression; }
+
+	lispa_ctx* previous = lctx_enter(ctx);
+	lval* x = NULL;
+	// Evaluate each expression, stopping at the first error
+	while (expression->count > 0) {
+		if (x) { lval_del(x); }
+		x = lval_eval(ctx->env, lval_pop(expression, 0));
+		if (x->type == LVAL_ERR) { break; }
+	}
+	lval_del(expression);
+	lctx_use(previous);
+	// Source with no expressions, only comments, evaluates to ()
+	return x ? x : lval_sexpr();
+}
+
+lispa_val* lispa_eval_file(lispa_ctx* ctx, const char* filename) {
+	lispa_ctx* previous = lctx_enter(ctx);
+	lval* x = builtin_load(ctx->env,
+		lval_add(lval_sexpr(), lval_str((char*)filename)));
+	lctx_use(previous);
+	return x;
+}
+
+char* lispa_serialize(lispa_ctx* ctx, lispa_val* v, size_t* len) {
+	lispa_ctx* previous = lctx_enter(ctx);
+	lval* encoded = lbin_encode(ctx->env, v);
+	lctx_use(previous);
+	char* data = NULL;
+	if (encoded->type != LVAL_ERR) {
+		*len = encoded->sbuf->len;
+		data = malloc(*len ? *len : 1);
+		memcpy(data, encoded->sbuf->data, *len);
+	}
+	lval_del(encoded);
+	return data;
+}
+
+lispa_val* lispa_deserialize(lispa_ctx* ctx, const char* data, size_t len) {
+	if (len > LONG_MAX) { return lval_err("'deserialize' passed too much data"); }
+	lispa_ctx* previous = lctx_enter(ctx);
+	lval* x = lbin_decode(ctx->env, (char*)data, len, NULL);
+	lctx_use(previous);
+	return x;
+}
+
+lispa_val* lispa_new_num(long num) { return lval_num(num); }
+lispa_val* lispa_new_str(const char* str) { return lval_str((char*)str); }
+lispa_val* lispa_new_err(const char* message) { return lval_err("%s", message); }
+lispa_val* lispa_new_list(void) { return lval_qexpr(); }
+lispa_val* lispa_list_add(lispa_val* list, lispa_val* item) {
+	return lval_add(list, item);
+}
+
+lispa_val* lispa_val_copy(lispa_val* v) { return lval_copy(v); }
+void lispa_val_del(lispa_val* v) { lval_del(v); }
+
+int lispa_val_type(lispa_val* v) { return v->type; }
+long lispa_val_num(lispa_val* v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+const char* lispa_val_str(lispa_val* v) {
+	switch (v->type) {
+		case LVAL_STR: return v->str;
+		case LVAL_SYM: return v->sym;
+		case LVAL_ERR: return v->err;
+		case LVAL_SBUF: return v->sbuf->data;
+		default: return NULL;
+	}
+}
+
+int lispa_val_count(lispa_val* v) {
+	switch (v->type) {
+		case LVAL_SEXPR:
+		case LVAL_QEXPR: return v->count;
+		case LVAL_VEC: return lval_vec_len(v);
+		default: return 0;
+	}
+}
+
+lispa_val* lispa_val_item(lispa_val* v, int i) {
+	if (i < 0 || i >= lispa_val_count(v)) { return NULL; }
+	return v->type == LVAL_VEC ? lval_vec_items(v)[i] : v->cell[i];
+}
+
+void lispa_val_println(lispa_ctx* ctx, lispa_val* v) {
+	lval_println(&ctx->out, v);
+}
@@ -0,0 +1,184 @@
+/*
+** lispa - A simple lisp programming language
+**
+** Embedding interface. A context is an interpreter of its own, so
+** several contexts can run on different threads at the same time.
+** A context must only be used by one thread at a time.
+*/
+
+#ifndef lispa_h
+#define lispa_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+// Interpreter context
+typedef struct lispa_ctx lispa_ctx;
+// Lisp value
+typedef struct lval lispa_val;
+// Environment a builtin is called in
+typedef struct lenv lispa_env;
+
+/*
+Native builtin function.
+It owns args, an S-Expression of its arguements, and must delete it.
+*/
+typedef lispa_val*(*lispa_builtin)(lispa_env* env, lispa_val* args);
+
+// Types of lisp values
+enum lispa_types {
+	LISPA_ERR,
+	LISPA_NUM,
+	LISPA_SYM,
+	LISPA_STR,
+	LISPA_FUNC,
+	LISPA_SEXPR,
+	LISPA_QEXPR,
+	LISPA_VEC,
+	LISPA_MAP,
+	LISPA_SBUF,
+	LISPA_SEQ,
+	LISPA_XFORM,
+	LISPA_FILE
+};
+
+/*
+Contexts
+*/
+
+/* Creates a context, loading the standard library file when not NULL */
+lispa_ctx* lispa_ctx_new(const char* stdlib);
+void lispa_ctx_del(lispa_ctx* ctx);
+
+/*
+Creates a context with its own copy of ctx's global environment.
+ctx must not be in use meanwhile, and must outlive the clone since
+they share parsers.
+*/
+lispa_ctx* lispa_ctx_clone(lispa_ctx* ctx);
+
+/* Changes whenever a global variable is defined or set */
+long lispa_ctx_version(lispa_ctx* ctx);
+
+/*
+Limits each evaluation from this interface to timeout_ms milliseconds
+and to about memory bytes of new values, 0 for no limit. An evaluation
+over a limit returns an error.
+*/
+void lispa_ctx_set_limits(lispa_ctx* ctx, long timeout_ms, long memory);
+
+/* Sets where print writes to, stdout by default */
+void lispa_ctx_set_output(lispa_ctx* ctx, FILE* file);
+
+/*
+While held, prints are not flushed one by one but only when the output
+buffer fills or lispa_ctx_flush is called. Releasing flushes.
+*/
+void lispa_ctx_hold_output(lispa_ctx* ctx, int hold);
+void lispa_ctx_flush(lispa_ctx* ctx);
+
+/* Adds a native builtin to the context's global environment */
+void lispa_register(lispa_ctx* ctx, const char* name, lispa_builtin func);
+
+/*
+Evaluation
+Returned values are owned by the caller and deleted with lispa_val_del.
+*/
+
+/*
+Evaluates each expression of source, returns the last result or first
+error. Never returns NULL, source without expressions gives ().
+*/
+lispa_val* lispa_eval_string(lispa_ctx* ctx, const char* source);
+
+/* Evaluates a file like load, returns () or an error if it can't be read */
+lispa_val* lispa_eval_file(lispa_ctx* ctx, const char* filename);
+
+/*
+Parses source once into an S-Expression holding every expression in it.
+Evaluating the result with lispa_eval repeatedly skips reparsing.
+*/
+lispa_val* lispa_parse(lispa_ctx* ctx, const char* source);
+
+/* Evaluates a copy of form, leaving form itself untouched */
+lispa_val* lispa_eval(lispa_ctx* ctx, lispa_val* form);
+
+/*
+Compiling hot lambdas that only do fixnum arithmetic to x86-64 machine
+code is on by default. Returns 0 if the JIT is not supported.
+*/
+int lispa_jit(int on);
+
+/*
+Serialization
+*/
+
+/*
+Encodes v in the binary format of serialize. Returns a buffer of *len
+bytes to free, or NULL if v holds a sequence, transducer or file.
+*/
+char* lispa_serialize(lispa_ctx* ctx, lispa_val* v, size_t* len);
+
+/*
+Decodes a value written by lispa_serialize or serialize, or returns an
+error. data is only read, so it may be a read-only mapping of a file.
+*/
+lispa_val* lispa_deserialize(lispa_ctx* ctx, const char* data, size_t len);
+
+/*
+Profiling
+*/
+
+/*
+Starts sampling which Lisp functions every thread is running, hz times
+per second of CPU time. Returns 0 if profiling is not supported.
+*/
+int lispa_profile_start(int hz);
+
+/*
+Stops sampling. Writes one line per distinct call stack with its sample
+count, the folded format flame graph tools read, and a report of the
+self and total time of each function. Either file may be NULL.
+*/
+void lispa_profile_stop(FILE* folded, FILE* report);
+
+/*
+Writes the allocation, copy and lookup counters of the calling thread.
+Returns 0 if lispa was built without -DLISPA_STATS.
+*/
+int lispa_stats_print(FILE* file);
+
+/*
+Values
+*/
+
+lispa_val* lispa_new_num(long num);
+lispa_val* lispa_new_str(const char* str);
+lispa_val* lispa_new_err(const char* message);
+lispa_val* lispa_new_list(void);
+/* Appends item to a list, taking ownership of item */
+lispa_val* lispa_list_add(lispa_val* list, lispa_val* item);
+
+lispa_val* lispa_val_copy(lispa_val* v);
+void lispa_val_del(lispa_val* v);
+
+int lispa_val_type(lispa_val* v);
+long lispa_val_num(lispa_val* v);
+/* Text of a string, symbol or error, or NULL */
+const char* lispa_val_str(lispa_val* v);
+/* Number of items of a list or vector */
+int lispa_val_count(lispa_val* v);
+/* Item i of a list or vector, still owned by v */
+lispa_val* lispa_val_item(lispa_val* v, int i);
+
+/* Prints a value and a newline to the context's output */
+void lispa_val_println(lispa_ctx* ctx, lispa_val* v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,713 @@
+/* lispa command line interface, built on the lispa library
+compile commands
+linux: cc -std=c99 -Wall main.c lispa.c mpc.c -ledit -lm -pthread -o lispa
+windows: cc -std=c99 -Wall main.c lispa.c mpc.c -o lispa
+*/
+
+// For pthreads and clock_gettime under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "lispa.h"
+
+// Threads are not used on windows
+#ifdef _WIN32
+#define LISPA_NO_THREADS
+#endif
+
+#ifndef LISPA_NO_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// The eval server uses epoll
+#if defined(__linux__) && !defined(LISPA_NO_THREADS)
+#define LISPA_SERVE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// If compiling on windows
+#ifdef _WIN32
+
+static char buffer[2048];
+
+// Fake readline function
+char* readline(char* prompt) {
+	fputs(prompt, stdout);
+	fgets(buffer, 2048, stdin);
+	char* cpy = malloc(strlen(buffer)+1);
+	strcpy(cpy, buffer);
+	cpy[strlen(cpy)-1] = '\0';
+	return cpy;
+}
+// Fake add_history function
+void add_history(char* unused) {}
+
+// Else, include editline headers
+#else
+#include <editline/readline.h>
+// mac X does not have history file
+//#include <editline/history.h>
+#endif
+
+// Interactive prompt
+void prompt(lispa_ctx* ctx) {
+	puts("Lispa Version 0.0.1");
+	puts("Press Ctrl+c to Exit\n");
+	// Loop until Ctrl+c or end of input
+	while (1) {
+		// Get user input
+		char* input = readline("lispa> ");
+		// End of input
+		if (!input) { putchar('\n'); break; }
+		// Add command history
+		add_history(input);
+
+		// The whole line is evaluated as one S-Expression
+		lispa_val* expression = lispa_parse(ctx, input);
+		if (lispa_val_type(expression) != LISPA_ERR) {
+			lispa_val* x = lispa_eval(ctx, expression);
+			lispa_val_println(ctx, x);
+			lispa_val_del(x);
+		} else {
+			// Else, print the parse error
+			lispa_val_println(ctx, expression);
+		}
+		lispa_val_del(expression);
+		free(input);
+	}
+}
+// Loads a lispa file from a filename, printing any error
+void load_file(lispa_ctx* ctx, char* filename) {
+	lispa_val* result = lispa_eval_file(ctx, filename);
+	if (lispa_val_type(result) == LISPA_ERR) {
+		printf("Unable to load file %s\n", filename);
+		lispa_val_println(ctx, result);
+	}
+	lispa_val_del(result);
+}
+// Loads multiple a lispa files from a list of filenames
+void load_files(lispa_ctx* ctx, int argc, char** argv) {
+	// Loop over each file name in argv
+	for (int i = 1; i < argc; i++) {
+		load_file(ctx, argv[i]);
+	}
+}
+
+// BATCH MODE
+
+#define LBATCH_READ 65536
+
+// Evaluates each expression of a complete piece of input, one result per line
+void lbatch_eval(lispa_ctx* ctx, char* input) {
+	// Skip blank input
+	char* c = input;
+	while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') { c++; }
+	if (*c == '\0') { return; }
+
+	lispa_val* expression = lispa_parse(ctx, input);
+	if (lispa_val_type(expression) == LISPA_ERR) {
+		lispa_val_println(ctx, expression);
+	} else {
+		for (int i = 0; i < lispa_val_count(expression); i++) {
+			lispa_val* x = lispa_eval(ctx, lispa_val_item(expression, i));
+			lispa_val_println(ctx, x);
+			lispa_val_del(x);
+		}
+	}
+	lispa_val_del(expression);
+}
+
+/*
+Evaluates expressions read from stdin against one environment.
+Input is cut at newlines outside of any form, string or comment, so a
+form may span lines. Output is flushed only before waiting for input.
+*/
+void lbatch_run(lispa_ctx* ctx) {
+	int capacity = LBATCH_READ;
+	char* data = malloc(capacity + 1);
+	int len = 0;
+	// Start of the unevaluated input and how far it has been scanned
+	int start = 0;
+	int scanned = 0;
+	// Scan state
+	int depth = 0;
+	bool string = false;
+	bool escape = false;
+	bool comment = false;
+
+	lispa_ctx_hold_output(ctx, 1);
+	while (1) {
+		int n = read(0, data + len, capacity - len);
+		if (n <= 0) { break; }
+		len += n;
+
+		for (; scanned < len; scanned++) {
+			char c = data[scanned];
+			if (string) {
+				if (escape) { escape = false; }
+				else if (c == '\\') { escape = true; }
+				else if (c == '"') { string = false; }
+				continue;
+			}
+			if (comment) {
+				if (c != '\n') { continue; }
+				comment = false;
+			}
+			switch (c) {
+				case ';': comment = true; break;
+				case '"': string = true; break;
+				case '(': case '{': depth++; break;
+				case ')': case '}': depth--; break;
+				case '\n':
+					// A stray closing bracket is left to the parser to report
+					if (depth > 0) { break; }
+					depth = 0;
+					data[scanned] = '\0';
+					lbatch_eval(ctx, data + start);
+					start = scanned + 1;
+					break;
+			}
+		}
+
+		// Move the unfinished input to the front, growing for long forms
+		memmove(data, data + start, len - start);
+		len -= start;
+		scanned -= start;
+		start = 0;
+		if (len == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity + 1);
+		}
+		lispa_ctx_flush(ctx);
+	}
+
+	// Input without a final newline
+	if (len > 0) {
+		data[len] = '\0';
+		lbatch_eval(ctx, data);
+	}
+	lispa_ctx_hold_output(ctx, 0);
+	free(data);
+}
+
+#ifdef LISPA_SERVE
+
+// SERVE MODE
+
+/*
+lispa --serve path keeps a warm context and evaluates requests sent over
+a Unix domain socket. A request is a 4 byte big endian length followed
+by that much source. The response is a 4 byte big endian length, then a
+status byte, 0 for a result or 1 for an error, then the text printed
+while evaluating followed by the result or error message.
+
+One thread runs an epoll loop over the connections and hands complete
+requests to worker threads. Each worker evaluates in its own clone of
+the warm context, taken again after a request changes its globals, so
+requests don't see each other's definitions.
+*/
+
+// Largest request accepted
+#define LSERVE_MAX_REQUEST (64 << 20)
+
+typedef struct lconn {
+	int fd;
+	// Received bytes not yet handed to a worker
+	char* in;
+	int in_len;
+	int in_capacity;
+	// Response being sent
+	char* out;
+	int out_len;
+	int out_sent;
+	// The request handed to a worker, and whether one is
+	char* request;
+	bool busy;
+	// The client hung up while its request was with a worker
+	bool closed;
+	// The client shut down its side, so close once its requests are answered
+	bool hung_up;
+	// Next in the request or response queue
+	struct lconn* next;
+} lconn;
+
+typedef struct lserve {
+	lispa_ctx* warm;
+	int epoll;
+	// Workers write to wake[1] when a response is ready
+	int wake[2];
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	// Requests waiting for a worker
+	lconn* requests;
+	lconn* requests_last;
+	// Responses waiting to be sent
+	lconn* responses;
+} lserve;
+
+static volatile sig_atomic_t lserve_stop = 0;
+
+void lserve_signal(int sig) {
+	lserve_stop = 1;
+}
+
+void lserve_put_len(char* buffer, unsigned int len) {
+	buffer[0] = len >> 24;
+	buffer[1] = len >> 16;
+	buffer[2] = len >> 8;
+	buffer[3] = len;
+}
+
+unsigned int lserve_get_len(char* buffer) {
+	unsigned char* b = (unsigned char*)buffer;
+	return (unsigned int)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+// Evaluates a request in ctx, returns the framed response
+char* lserve_eval(lispa_ctx* ctx, char* request, int* len) {
+	char* text;
+	size_t size;
+	FILE* output = open_memstream(&text, &size);
+	lispa_ctx_set_output(ctx, output);
+
+	lispa_val* x = lispa_eval_string(ctx, request);
+	int status = lispa_val_type(x) == LISPA_ERR;
+	if (status) {
+		lispa_ctx_flush(ctx);
+		fputs(lispa_val_str(x), output);
+	} else {
+		lispa_val_println(ctx, x);
+	}
+	lispa_val_del(x);
+	lispa_ctx_set_output(ctx, stdout);
+	fclose(output);
+
+	*len = 5 + size;
+	char* response = malloc(*len);
+	lserve_put_len(response, size + 1);
+	response[4] = status;
+	memcpy(response + 5, text, size);
+	free(text);
+	return response;
+}
+
+void* lserve_worker(void* arg) {
+	lserve* server = arg;
+	lispa_ctx* ctx = lispa_ctx_clone(server->warm);
+	long version = lispa_ctx_version(ctx);
+	while (1) {
+		// Take the oldest request
+		pthread_mutex_lock(&server->lock);
+		while (!server->requests) {
+			pthread_cond_wait(&server->ready, &server->lock);
+		}
+		lconn* conn = server->requests;
+		server->requests = conn->next;
+		pthread_mutex_unlock(&server->lock);
+
+		char* response = lserve_eval(ctx, conn->request, &conn->out_len);
+		free(conn->request);
+		conn->request = NULL;
+
+		// Start again from the warm context if globals were changed
+		if (lispa_ctx_version(ctx) != version) {
+			lispa_ctx_del(ctx);
+			ctx = lispa_ctx_clone(server->warm);
+			version = lispa_ctx_version(ctx);
+		}
+
+		// Hand the response back to the event loop
+		pthread_mutex_lock(&server->lock);
+		conn->out = response;
+		conn->out_sent = 0;
+		conn->next = server->responses;
+		server->responses = conn;
+		pthread_mutex_unlock(&server->lock);
+		char wake = 0;
+		write(server->wake[1], &wake, 1);
+	}
+	return NULL;
+}
+
+void lserve_close(lserve* server, lconn* conn) {
+	epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	// A busy connection is freed when its response comes back
+	if (conn->busy) {
+		conn->closed = true;
+		return;
+	}
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+void lserve_watch(lserve* server, lconn* conn, unsigned int events) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = conn;
+	epoll_ctl(server->epoll, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/*
+Hands the next complete request of conn to the workers. Closes conn when
+the request is too long, or when the client hung up and every request it
+sent is answered.
+*/
+void lserve_dispatch(lserve* server, lconn* conn) {
+	if (conn->busy || conn->out) { return; }
+	unsigned int len = conn->in_len < 4 ? 0 : lserve_get_len(conn->in);
+	if (len > LSERVE_MAX_REQUEST
+		|| (conn->in_len < 4 + (int)len && conn->hung_up)) {
+		lserve_close(server, conn);
+		return;
+	}
+	if (conn->in_len < 4 + (int)len) { return; }
+
+	conn->request = malloc(len + 1);
+	memcpy(conn->request, conn->in + 4, len);
+	conn->request[len] = '\0';
+	conn->in_len -= 4 + len;
+	memmove(conn->in, conn->in + 4 + len, conn->in_len);
+	conn->busy = true;
+
+	pthread_mutex_lock(&server->lock);
+	conn->next = NULL;
+	if (server->requests) {
+		server->requests_last->next = conn;
+	} else {
+		server->requests = conn;
+	}
+	server->requests_last = conn;
+	pthread_cond_signal(&server->ready);
+	pthread_mutex_unlock(&server->lock);
+}
+
+// Sends what it can of conn's response, waiting for EPOLLOUT for the rest
+void lserve_send(lserve* server, lconn* conn) {
+	while (conn->out_sent < conn->out_len) {
+		ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+			conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				lserve_watch(server, conn, conn->hung_up ? EPOLLOUT : EPOLLIN | EPOLLOUT);
+				return;
+			}
+			if (errno == EINTR) { continue; }
+			lserve_close(server, conn);
+			return;
+		}
+		conn->out_sent += n;
+	}
+	free(conn->out);
+	conn->out = NULL;
+	lserve_watch(server, conn, conn->hung_up ? 0 : EPOLLIN);
+	lserve_dispatch(server, conn);
+}
+
+// Reads everything available on conn
+void lserve_receive(lserve* server, lconn* conn) {
+	while (1) {
+		if (conn->in_len == conn->in_capacity) {
+			conn->in_capacity *= 2;
+			conn->in = realloc(conn->in, conn->in_capacity);
+		}
+		ssize_t n = read(conn->fd, conn->in + conn->in_len,
+			conn->in_capacity - conn->in_len);
+		if (n > 0) {
+			conn->in_len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) { continue; }
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+		// Failed, or hung up fully once the reading side was shut down
+		if (n < 0 || conn->hung_up) {
+			lserve_close(server, conn);
+			return;
+		}
+		// The client is done sending, but still waits for the answers to
+		// what it sent, so only stop reading
+		conn->hung_up = true;
+		lserve_watch(server, conn, 0);
+		break;
+	}
+	lserve_dispatch(server, conn);
+}
+
+void lserve_accept(lserve* server, int listener) {
+	while (1) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) { return; }
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		lconn* conn = calloc(1, sizeof(lconn));
+		conn->fd = fd;
+		conn->in_capacity = 4096;
+		conn->in = malloc(conn->in_capacity);
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+// Sends the responses the workers finished
+void lserve_respond(lserve* server) {
+	char drain[256];
+	while (read(server->wake[0], drain, sizeof(drain)) > 0) {}
+
+	pthread_mutex_lock(&server->lock);
+	lconn* conn = server->responses;
+	server->responses = NULL;
+	pthread_mutex_unlock(&server->lock);
+
+	while (conn) {
+		lconn* next = conn->next;
+		conn->busy = false;
+		if (conn->closed) {
+			free(conn->in);
+			free(conn->out);
+			free(conn);
+		} else {
+			lserve_send(server, conn);
+		}
+		conn = next;
+	}
+}
+
+/*
+lispa --serve path [--workers n] [--timeout ms] [--memory bytes]
+Runs until interrupted, then removes the socket.
+*/
+int lserve_run(int argc, char** argv) {
+	char* path = argv[2];
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	long timeout_ms = 5000;
+	long memory = 256L << 20;
+	for (int i = 3; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--workers") == 0) { workers = atol(argv[i+1]); }
+		else if (strcmp(argv[i], "--timeout") == 0) { timeout_ms = atol(argv[i+1]); }
+		else if (strcmp(argv[i], "--memory") == 0) { memory = atol(argv[i+1]); }
+	}
+	if (workers < 1) { workers = 1; }
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", path);
+		return 1;
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (listener < 0
+		|| bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0
+		|| listen(listener, 128) < 0) {
+		perror("Unable to serve");
+		return 1;
+	}
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	lserve server;
+	memset(&server, 0, sizeof(server));
+	server.warm = lispa_ctx_new("stlib.lspy");
+	lispa_ctx_set_limits(server.warm, timeout_ms, memory);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.ready, NULL);
+	pipe(server.wake);
+	fcntl(server.wake[0], F_SETFL, fcntl(server.wake[0], F_GETFL) | O_NONBLOCK);
+
+	server.epoll = epoll_create1(0);
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &listener;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, listener, &event);
+	event.data.ptr = &server.wake;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.wake[0], &event);
+
+	for (long i = 0; i < workers; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, lserve_worker, &server);
+		pthread_detach(thread);
+	}
+
+	signal(SIGINT, lserve_signal);
+	signal(SIGTERM, lserve_signal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("Serving on %s with %li workers\n", path, workers);
+	fflush(stdout);
+
+	struct epoll_event events[64];
+	while (!lserve_stop) {
+		int count = epoll_wait(server.epoll, events, 64, -1);
+		for (int i = 0; i < count; i++) {
+			void* source = events[i].data.ptr;
+			if (source == &listener) {
+				lserve_accept(&server, listener);
+			} else if (source == &server.wake) {
+				lserve_respond(&server);
+			} else if (events[i].events & EPOLLOUT) {
+				lserve_send(&server, source);
+			} else {
+				lserve_receive(&server, source);
+			}
+		}
+	}
+
+	// Workers may still be running, the process exit ends them
+	unlink(path);
+	return 0;
+}
+
+#endif
+
+#ifndef LISPA_NO_THREADS
+
+typedef struct lbench_run {
+	pthread_t thread;
+	int argc;
+	char** argv;
+} lbench_run;
+
+// Runs the files in a context of its own
+void* lbench_context(void* arg) {
+	lbench_run* run = arg;
+	lispa_ctx* ctx = lispa_ctx_new("stlib.lspy");
+	// Output is not part of the measurement
+	FILE* null = fopen("/dev/null", "w");
+	lispa_ctx_set_output(ctx, null);
+	for (int i = 0; i < run->argc; i++) {
+		load_file(ctx, run->argv[i]);
+	}
+	lispa_ctx_set_output(ctx, stdout);
+	fclose(null);
+	lispa_ctx_del(ctx);
+	return NULL;
+}
+
+double lbench_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+Runs the files in 1, 2, 4 ... up to n contexts at once, each on its
+own thread, and prints how throughput scales with the threads.
+*/
+void lbench_contexts(int n, int argc, char** argv) {
+	double single = 0;
+	printf("contexts  seconds  runs/s   speedup\n");
+	int count = 1;
+	while (count <= n) {
+		lbench_run* runs = calloc(count, sizeof(lbench_run));
+		double start = lbench_now();
+		for (int i = 0; i < count; i++) {
+			runs[i].argc = argc;
+			runs[i].argv = argv;
+			pthread_create(&runs[i].thread, NULL, lbench_context, &runs[i]);
+		}
+		for (int i = 0; i < count; i++) {
+			pthread_join(runs[i].thread, NULL);
+		}
+		double seconds = lbench_now() - start;
+		free(runs);
+
+		double rate = count / seconds;
+		if (count == 1) { single = rate; }
+		printf("%8i  %7.3f  %7.2f  %7.2fx\n", count, seconds, rate, rate / single);
+
+		if (count == n) { break; }
+		count = count * 2 < n ? count * 2 : n;
+	}
+}
+
+#endif
+
+int main(int argc, char** argv) {
+	// lispa --no-jit ..., every lambda is interpreted
+	if (argc >= 2 && strcmp(argv[1], "--no-jit") == 0) {
+		lispa_jit(0);
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
+#ifndef LISPA_NO_THREADS
+	// lispa --bench-contexts n files...
+	if (argc >= 3 && strcmp(argv[1], "--bench-contexts") == 0) {
+		lbench_contexts(atoi(argv[2]), argc - 3, argv + 3);
+		return 0;
+	}
+#endif
+#ifdef LISPA_SERVE
+	// lispa --serve path [--workers n] [--timeout ms] [--memory bytes]
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+		return lserve_run(argc, argv);
+	}
+#endif
+
+	// lispa --stats ..., counters are written to stderr at exit
+	bool stats = argc >= 2 && strcmp(argv[1], "--stats") == 0;
+	if (stats) {
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
+	lispa_ctx* ctx = lispa_ctx_new("stlib.lspy");
+
+	// lispa --profile out.folded files...
+	if (argc >= 4 && strcmp(argv[1], "--profile") == 0) {
+		FILE* folded = fopen(argv[2], "w");
+		if (!folded) {
+			perror(argv[2]);
+			lispa_ctx_del(ctx);
+			return 1;
+		}
+		if (!lispa_profile_start(1000)) {
+			fprintf(stderr, "Profiling is not supported on this platform\n");
+		}
+		load_files(ctx, argc - 2, argv + 2);
+		// The report goes to stderr, apart from the program's output
+		lispa_profile_stop(folded, stderr);
+		fclose(folded);
+	}
+	// lispa --batch, expressions from stdin
+	else if (argc == 2 && strcmp(argv[1], "--batch") == 0) {
+		lbatch_run(ctx);
+	}
+	// If there is 1 or more files
+	else if (argc >= 2) {
+		load_files(ctx, argc, argv);
+	}
+	// If there no files, show interactive prompt
+	else if (argc == 1) {
+		prompt(ctx);
+	}
+
+	lispa_ctx_del(ctx);
+	if (stats && !lispa_stats_print(stderr)) {
+		fprintf(stderr, "Statistics need lispa built with -DLISPA_STATS\n");
+	}
+	return 0;
+}